@@ -0,0 +1,333 @@
+#!/usr/bin/env python3
+"""
+stream_bench.py
+
+Runs stream_test_source -> stream_router -> stream_test_subscriber on loopback for every
+combination of payload size, source count, router queue depth and wait strategy given,
+and writes one row per run to <out>.csv and <out>.json so that a router change can be
+compared against a baseline run.
+
+Each run starts the router with its metrics endpoint on a Unix socket and latency
+measurement on, starts the subscribers, then the sources. Once every source has exited
+and the router has published everything the subscribers and router are stopped with
+^C and their summaries are read. Throughput is records and bytes published by the
+router over the wall clock time from starting the sources to the last record being
+published, CPU time comes from the exit status of each process.
+
+    ./stream_bench.py --sizes 1000,100000 --sources 1,4 --depths 100,1000 --waits sleep,block
+    ./stream_bench.py --baseline bench_results.json --out bench_new
+"""
+
+import argparse
+import csv
+import itertools
+import json
+import os
+import re
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+FIRST_SOURCE_ID = 0xC0DA0001
+
+COLUMNS = [
+    "size", "sources", "subscribers", "depth", "wait",
+    "records_sent", "records_received", "records_published", "records_delivered", "records_missing",
+    "seconds", "records_per_second", "gbytes_per_second",
+    "router_cpu_seconds", "router_cpu_per_gbyte", "source_cpu_per_gbyte", "subscriber_cpu_per_gbyte",
+    "ingest_p50_us", "ingest_p99_us", "ingest_p999_us", "ingest_max_us",
+    "publish_p50_us", "publish_p99_us", "publish_p999_us", "publish_max_us",
+    "receive_p50_us", "receive_p99_us", "receive_p999_us", "receive_max_us",
+]
+
+# Lines printed by the router and subscriber, see stream_hist_print and stream_sequence_print
+SUMMARY = re.compile(r"ID ([0-9A-F]{8}) (\w+) latency summary - (\d+) records, p50 ([\d.]+) us, "
+                     r"p99 ([\d.]+) us, p99.9 ([\d.]+) us, max ([\d.]+) us")
+SEQUENCE = re.compile(r"ID ([0-9A-F]{8}) - (\d+) records, (?:no gaps|(\d+) missing)")
+METRIC = re.compile(r"^(\w+)(?:\{([^}]*)\})? (\S+)$")
+
+
+def int_list(text):
+    return [int(v) for v in text.split(",")]
+
+
+def str_list(text):
+    return text.split(",")
+
+
+class Process:
+    """A child whose output goes to a log file and whose CPU time is collected at exit."""
+
+    def __init__(self, args, log_path):
+        self.args = args
+        self.log_path = log_path
+        self.log = open(log_path, "w")
+        self.popen = subprocess.Popen(args, stdout=self.log, stderr=subprocess.STDOUT)
+        self.cpu = None
+
+    def poll(self):
+        if self.cpu is not None:
+            return True
+        pid, status, usage = os.wait4(self.popen.pid, os.WNOHANG)
+        if pid == 0:
+            return False
+        self.popen.returncode = status
+        self.cpu = usage.ru_utime + usage.ru_stime
+        self.log.close()
+        return True
+
+    def wait(self, timeout):
+        deadline = time.monotonic() + timeout
+        while not self.poll():
+            if time.monotonic() > deadline:
+                return False
+            time.sleep(0.02)
+        return True
+
+    def stop(self, timeout=5.0):
+        """^C, then kill if it doesn't go."""
+        if self.poll():
+            return
+        self.popen.send_signal(signal.SIGINT)
+        if not self.wait(timeout):
+            self.popen.kill()
+            self.wait(timeout)
+
+    def output(self):
+        with open(self.log_path) as f:
+            return f.read()
+
+
+def scrape(path):
+    """Metrics from the router's Unix socket as {name: [(labels, value)]}, None if it isn't up."""
+    try:
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.settimeout(2.0)
+        s.connect(path)
+        s.sendall(b"GET /metrics HTTP/1.0\r\n\r\n")
+        data = b""
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+        s.close()
+    except OSError:
+        return None
+    metrics = {}
+    body = data.decode(errors="replace").split("\r\n\r\n", 1)[-1]
+    for line in body.splitlines():
+        m = METRIC.match(line)
+        if m:
+            labels = dict(re.findall(r'(\w+)="([^"]*)"', m.group(2) or ""))
+            metrics.setdefault(m.group(1), []).append((labels, float(m.group(3))))
+    return metrics
+
+
+def total(metrics, name):
+    return sum(value for _, value in metrics.get(name, []))
+
+
+def worst_latency(outputs, point):
+    """Largest p50, p99, p99.9 and max over all sources for a measuring point."""
+    worst = [None, None, None, None]
+    for text in outputs:
+        for m in SUMMARY.finditer(text):
+            if m.group(2) != point or int(m.group(3)) == 0:
+                continue
+            for i in range(4):
+                value = float(m.group(4 + i))
+                worst[i] = value if worst[i] is None else max(worst[i], value)
+    return worst
+
+
+def per_gbyte(cpu, nbytes):
+    return round(cpu / (nbytes / 1e9), 4) if nbytes > 0 else None
+
+
+def run(opts, size, sources, depth, wait, index, workdir):
+    port = opts.port + 3 * index
+    publish_url = "tcp://127.0.0.1:%d" % (port + 1)
+    metrics_path = os.path.join(workdir, "router-%d.sock" % index)
+    log = lambda name: os.path.join(workdir, "%s-%d.log" % (name, index))
+    binary = lambda name: os.path.join(opts.bin, name)
+    ids = [FIRST_SOURCE_ID + i for i in range(sources)]
+
+    router_args = [binary("stream_router"), "-z", "-l", "-p", str(port), "-u", "tcp://*:%d" % (port + 1),
+                   "-q", str(depth), "-w", wait, "-E", metrics_path] + opts.router_args.split()
+    # A subscriber can only ask for more than one source through a router filter
+    if sources > 1 and opts.subscribers > 0:
+        router_args.append("-x")
+    router = Process(router_args, log("router"))
+    deadline = time.monotonic() + 10
+    while scrape(metrics_path) is None:
+        if router.poll() or time.monotonic() > deadline:
+            router.stop()
+            raise RuntimeError("router didn't start, see %s" % log("router"))
+        time.sleep(0.05)
+
+    keys = ",".join("0x%08X" % i for i in ids)
+    subscribers = [Process([binary("stream_test_subscriber"), "-l", "-u", publish_url, keys],
+                           log("subscriber%d" % k)) for k in range(opts.subscribers)]
+    # Give ZeroMQ time to connect the subscribers before anything is published
+    time.sleep(opts.settle)
+
+    cycles = opts.cycles
+    loops = max(1, opts.records // cycles)
+    started = time.monotonic()
+    source_procs = [Process([binary("stream_test_source"), "-p", str(port), "-i", "0x%08X" % i,
+                             "-n", str(loops), "-l", str(cycles), "-b", str(size), "-w", wait]
+                            + opts.source_args.split(), log("source%d" % k))
+                    for k, i in enumerate(ids)]
+    for p in source_procs:
+        if not p.wait(opts.timeout):
+            p.stop()
+    sent = loops * cycles * sources
+
+    # Wait until the router has published everything it received, or stops making progress
+    metrics = scrape(metrics_path) or {}
+    last_change, last_published = time.monotonic(), -1
+    finished = time.monotonic()
+    while True:
+        published = total(metrics, "stream_router_published_records_total")
+        now = time.monotonic()
+        if published != last_published:
+            last_published, last_change, finished = published, now, now
+        if published >= sent or now - last_change > 2.0:
+            break
+        time.sleep(0.02)
+        metrics = scrape(metrics_path) or metrics
+    seconds = finished - started
+
+    time.sleep(opts.settle)
+    for p in subscribers:
+        p.stop()
+    router.stop()
+
+    published = total(metrics, "stream_router_published_records_total")
+    published_bytes = total(metrics, "stream_router_published_bytes_total")
+    router_out = router.output()
+    # Connections leave the metrics when they close, their ingest summaries count what arrived
+    received = sum(int(m.group(3)) for m in SUMMARY.finditer(router_out) if m.group(2) == "ingest")
+    subscriber_out = [p.output() for p in subscribers]
+    delivered = missing = 0
+    for text in subscriber_out:
+        # The counts are cumulative and a source's line is printed again every 10 s while it
+        # has anomalies, so only the last line for each source counts
+        last = {m.group(1): m for m in SEQUENCE.finditer(text)}
+        for m in last.values():
+            delivered += int(m.group(2))
+            missing += int(m.group(3) or 0)
+    source_cpu = sum(p.cpu or 0.0 for p in source_procs)
+    subscriber_cpu = sum(p.cpu or 0.0 for p in subscribers)
+
+    row = {
+        "size": size, "sources": sources, "subscribers": opts.subscribers, "depth": depth, "wait": wait,
+        "records_sent": sent, "records_received": int(received), "records_published": int(published),
+        "records_delivered": delivered if subscribers else None,
+        "records_missing": missing if subscribers else None,
+        "seconds": round(seconds, 4),
+        "records_per_second": round(published / seconds, 1) if seconds > 0 else None,
+        "gbytes_per_second": round(published_bytes / seconds / 1e9, 6) if seconds > 0 else None,
+        "router_cpu_seconds": round(router.cpu or 0.0, 4),
+        "router_cpu_per_gbyte": per_gbyte(router.cpu or 0.0, published_bytes),
+        "source_cpu_per_gbyte": per_gbyte(source_cpu, published_bytes),
+        "subscriber_cpu_per_gbyte": per_gbyte(subscriber_cpu, published_bytes * len(subscribers)) if subscribers else None,
+    }
+    for point, values in (("ingest", worst_latency([router_out], "ingest")),
+                          ("publish", worst_latency([router_out], "publish")),
+                          ("receive", worst_latency(subscriber_out, "receive"))):
+        for name, value in zip(("p50", "p99", "p999", "max"), values):
+            row["%s_%s_us" % (point, name)] = value
+    return row
+
+
+def config_key(row):
+    return (row["size"], row["sources"], row["subscribers"], row["depth"], row["wait"])
+
+
+def compare(rows, baseline_path, tolerance):
+    """Print the change from a baseline run, returns False if throughput fell by more than tolerance %."""
+    with open(baseline_path) as f:
+        baseline = {config_key(r): r for r in json.load(f)["results"]}
+    ok = True
+    print("\n%-36s %12s %12s %8s %12s %12s" % ("size/sources/subscribers/depth/wait", "base rec/s", "rec/s",
+                                                "change", "base p99 us", "p99 us"))
+    for row in rows:
+        base = baseline.get(config_key(row))
+        if base is None or not base["records_per_second"] or not row["records_per_second"]:
+            continue
+        change = 100.0 * (row["records_per_second"] / base["records_per_second"] - 1.0)
+        flag = ""
+        if change < -tolerance:
+            flag = "  <-- slower"
+            ok = False
+        print("%-36s %12.0f %12.0f %7.1f%% %12s %12s%s" % (
+            "/".join(str(v) for v in config_key(row)), base["records_per_second"], row["records_per_second"],
+            change, base["publish_p99_us"], row["publish_p99_us"], flag))
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark source -> router -> subscriber on loopback")
+    parser.add_argument("--bin", default=".", help="directory holding the three programs [.]")
+    parser.add_argument("--sizes", type=int_list, default=[1000, 10000, 100000], help="payload bytes per record")
+    parser.add_argument("--sources", type=int_list, default=[1], help="number of sources")
+    parser.add_argument("--depths", type=int_list, default=[100], help="router output queue depths, -q")
+    parser.add_argument("--waits", type=str_list, default=["sleep"], help="queue wait strategies, -w")
+    parser.add_argument("--subscribers", type=int, default=1, help="subscribers, each takes every source [1]")
+    parser.add_argument("--records", type=int, default=100000, help="records per source per run [100000]")
+    parser.add_argument("--cycles", type=int, default=10, help="rate measurements per source, -l [10]")
+    parser.add_argument("--port", type=int, default=5655, help="first port, each run uses three from here [5655]")
+    parser.add_argument("--settle", type=float, default=1.0, help="seconds for ZeroMQ to connect and drain [1]")
+    parser.add_argument("--timeout", type=float, default=300.0, help="most seconds a source may run [300]")
+    parser.add_argument("--router-args", default="", help="extra stream_router options for every run")
+    parser.add_argument("--source-args", default="", help="extra stream_test_source options for every run")
+    parser.add_argument("--out", default="bench_results", help="write <out>.csv and <out>.json [bench_results]")
+    parser.add_argument("--baseline", help="compare with the .json of an earlier run")
+    parser.add_argument("--tolerance", type=float, default=5.0,
+                        help="with --baseline exit 1 if records/s fell by more than this percent [5]")
+    parser.add_argument("--keep-logs", action="store_true", help="keep the programs' output")
+    opts = parser.parse_args()
+
+    workdir = tempfile.mkdtemp(prefix="stream_bench.")
+    rows = []
+    configs = list(itertools.product(opts.sizes, opts.sources, opts.depths, opts.waits))
+    try:
+        for index, (size, sources, depth, wait) in enumerate(configs):
+            print("run %d/%d: %d bytes, %d sources, %d subscribers, depth %d, wait %s" % (
+                index + 1, len(configs), size, sources, opts.subscribers, depth, wait), flush=True)
+            row = run(opts, size, sources, depth, wait, index, workdir)
+            print("\t%s records/s, %s GByte/s, router %s CPU s/GByte, publish p99 %s us, receive p99 %s us" % (
+                row["records_per_second"], row["gbytes_per_second"], row["router_cpu_per_gbyte"],
+                row["publish_p99_us"], row["receive_p99_us"]), flush=True)
+            rows.append(row)
+    finally:
+        if opts.keep_logs:
+            print("Logs are in %s" % workdir)
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+
+    with open(opts.out + ".csv", "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=COLUMNS)
+        writer.writeheader()
+        writer.writerows(rows)
+    try:
+        commit = subprocess.run(["git", "rev-parse", "--short", "HEAD"], capture_output=True, text=True,
+                                cwd=os.path.dirname(os.path.abspath(__file__))).stdout.strip()
+    except OSError:
+        commit = ""
+    with open(opts.out + ".json", "w") as f:
+        json.dump({"date": time.strftime("%Y-%m-%dT%H:%M:%S%z"), "host": socket.gethostname(),
+                   "commit": commit, "cpus": os.cpu_count(), "command": sys.argv, "results": rows}, f, indent=2)
+    print("Results in %s.csv and %s.json" % (opts.out, opts.out))
+    if opts.baseline and not compare(rows, opts.baseline, opts.tolerance):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,166 @@
+/*
+ * stream_codec.c
+ *
+ * See stream_codec.h
+ */
+
+#include "stream_codec.h"
+#include "stream_tools.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_SNAPPY
+#include <snappy-c.h>
+#endif
+
+static const char *codec_names[] = {"none", "lz4", "zstd", "snappy"};
+
+#ifdef HAVE_ZSTD
+// zstd is much faster with a reused context. Every thread that compresses keeps its
+// own, they live as long as the thread.
+static __thread ZSTD_CCtx *zstd_cctx;
+static __thread ZSTD_DCtx *zstd_dctx;
+#endif
+
+static int codec_built_in(stream_codec_t codec) {
+    switch (codec) {
+        case STREAM_CODEC_NONE:
+            return TRUE;
+#ifdef HAVE_LZ4
+        case STREAM_CODEC_LZ4:
+            return TRUE;
+#endif
+#ifdef HAVE_ZSTD
+        case STREAM_CODEC_ZSTD:
+            return TRUE;
+#endif
+#ifdef HAVE_SNAPPY
+        case STREAM_CODEC_SNAPPY:
+            return TRUE;
+#endif
+        default:
+            return FALSE;
+    }
+}
+
+int stream_codec_parse(const char *spec, stream_codec_t *codec, int *level) {
+    int i;
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t) (colon - spec) : strlen(spec);
+    for (i = 0; i < sizeof(codec_names) / sizeof(codec_names[0]); i++) {
+        if (strlen(codec_names[i]) == len && strncmp(spec, codec_names[i], len) == 0) {
+            if (!codec_built_in(i))
+                return -1;
+            *codec = i;
+            *level = colon ? atoi(colon + 1) : STREAM_CODEC_DEFAULT_LEVEL;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *stream_codec_name(stream_codec_t codec) {
+    if (codec >= sizeof(codec_names) / sizeof(codec_names[0]))
+        return "unknown";
+    return codec_names[codec];
+}
+
+stream_codec_t stream_codec_of(uint32_t flags) {
+    return (flags & STREAM_FLAG_CODEC_MASK) >> STREAM_FLAG_CODEC_SHIFT;
+}
+
+size_t stream_codec_bound(stream_codec_t codec, size_t length) {
+    switch (codec) {
+#ifdef HAVE_LZ4
+        case STREAM_CODEC_LZ4:
+            return LZ4_compressBound(length);
+#endif
+#ifdef HAVE_ZSTD
+        case STREAM_CODEC_ZSTD:
+            return ZSTD_compressBound(length);
+#endif
+#ifdef HAVE_SNAPPY
+        case STREAM_CODEC_SNAPPY:
+            return snappy_max_compressed_length(length);
+#endif
+        default:
+            return length;
+    }
+}
+
+size_t stream_codec_compress(stream_codec_t codec, int level, const void *src, size_t length,
+                             void *dst, size_t capacity) {
+    switch (codec) {
+        case STREAM_CODEC_NONE:
+            if (length > capacity)
+                return 0;
+            memcpy(dst, src, length);
+            return length;
+#ifdef HAVE_LZ4
+        case STREAM_CODEC_LZ4: {
+            int n = LZ4_compress_fast(src, dst, length, capacity, level > 1 ? level : 1);
+            return n > 0 ? n : 0;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case STREAM_CODEC_ZSTD: {
+            if (zstd_cctx == NULL && (zstd_cctx = ZSTD_createCCtx()) == NULL)
+                return 0;
+            size_t n = ZSTD_compressCCtx(zstd_cctx, dst, capacity, src, length, level);
+            return ZSTD_isError(n) ? 0 : n;
+        }
+#endif
+#ifdef HAVE_SNAPPY
+        case STREAM_CODEC_SNAPPY: {
+            size_t n = capacity;
+            if (snappy_compress(src, length, dst, &n) != SNAPPY_OK)
+                return 0;
+            return n;
+        }
+#endif
+        default:
+            return 0;
+    }
+}
+
+ssize_t stream_codec_decompress(stream_codec_t codec, const void *src, size_t length,
+                                void *dst, size_t capacity) {
+    switch (codec) {
+        case STREAM_CODEC_NONE:
+            if (length > capacity)
+                return -1;
+            memcpy(dst, src, length);
+            return length;
+#ifdef HAVE_LZ4
+        case STREAM_CODEC_LZ4: {
+            int n = LZ4_decompress_safe(src, dst, length, capacity);
+            return n >= 0 ? n : -1;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case STREAM_CODEC_ZSTD: {
+            if (zstd_dctx == NULL && (zstd_dctx = ZSTD_createDCtx()) == NULL)
+                return -1;
+            size_t n = ZSTD_decompressDCtx(zstd_dctx, dst, capacity, src, length);
+            return ZSTD_isError(n) ? -1 : (ssize_t) n;
+        }
+#endif
+#ifdef HAVE_SNAPPY
+        case STREAM_CODEC_SNAPPY: {
+            size_t n = capacity;
+            if (snappy_uncompress(src, length, dst, &n) != SNAPPY_OK)
+                return -1;
+            return n;
+        }
+#endif
+        default:
+            return -1;
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * stream_codec.h
+ *
+ * Payload compression for stream records. Each codec is only built in when its
+ * library is, HAVE_LZ4, HAVE_ZSTD and HAVE_SNAPPY are set by the build when the
+ * headers are found. STREAM_CODEC_NONE is always there and just copies.
+ *
+ * A compressed record keeps the normal header. compressed_length holds the size of
+ * the compressed payload, payload_length the size it expands to, total_length covers
+ * the header and the compressed payload padded to 4 bytes and the codec that was
+ * used is in the flags word, see STREAM_FLAG_CODEC_MASK in stream_tools.h.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef STREAM_CODEC_H_
+#define STREAM_CODEC_H_
+
+typedef enum stream_codec {
+    STREAM_CODEC_NONE = 0,
+    STREAM_CODEC_LZ4,
+    STREAM_CODEC_ZSTD,
+    STREAM_CODEC_SNAPPY
+} stream_codec_t;
+
+// Level used by stream_codec_parse when none is given, 0 is the codec's own default.
+// Only zstd has levels, for lz4 a level above 1 is the acceleration factor of
+// LZ4_compress_fast and snappy ignores it.
+#define STREAM_CODEC_DEFAULT_LEVEL 0
+
+// Parse "none", "lz4", "zstd" or "snappy", optionally followed by ":<level>".
+// Returns -1 if the codec is unknown or wasn't built in.
+int stream_codec_parse(const char *spec, stream_codec_t *codec, int *level);
+
+const char *stream_codec_name(stream_codec_t codec);
+
+// Codec of a record from its flags word
+stream_codec_t stream_codec_of(uint32_t flags);
+
+// Largest compressed size of length bytes of input
+size_t stream_codec_bound(stream_codec_t codec, size_t length);
+
+// Compress length bytes from src into dst, which holds capacity bytes.
+// Returns the compressed size, 0 on failure.
+size_t stream_codec_compress(stream_codec_t codec, int level, const void *src, size_t length,
+                             void *dst, size_t capacity);
+
+// Expand length bytes from src into dst, which holds capacity bytes.
+// Returns the expanded size, -1 if the data is corrupt or doesn't fit.
+ssize_t stream_codec_decompress(stream_codec_t codec, const void *src, size_t length,
+                                void *dst, size_t capacity);
+
+#endif /* STREAM_CODEC_H_ */
@@ -0,0 +1,137 @@
+/*
+ * stream_journal.c
+ *
+ * See stream_journal.h
+ */
+
+#include "stream_journal.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// total_length is always a multiple of 4, so records follow one another exactly as they
+// do on the wire and in a stream_test_subscriber recording
+#define JOURNAL_ALIGN(n) (((n) + 3) & ~(size_t) 3)
+
+static void segment_name(stream_journal_t *j, uint64_t sequence, char *name, size_t len) {
+    snprintf(name, len, "%s-%06llu.journal", j->path, (unsigned long long) sequence);
+}
+
+static stream_journal_segment_t *segment(stream_journal_t *j, int i) {
+    return &j->segments[(j->first + i) % j->max_segments];
+}
+
+// Start a new segment at the end of the ring, returns -1 if the cap is reached or the
+// file can't be made.
+static int segment_add(stream_journal_t *j) {
+    char name[1024];
+    if (j->count == j->max_segments)
+        return -1;
+    stream_journal_segment_t *s = segment(j, j->count);
+    s->sequence = j->next_sequence++;
+    segment_name(j, s->sequence, name, sizeof(name));
+    s->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (s->fd < 0) {
+        perror("journal open");
+        return -1;
+    }
+    if (ftruncate(s->fd, j->segment_size) < 0) {
+        perror("journal ftruncate");
+        close(s->fd);
+        unlink(name);
+        return -1;
+    }
+    s->map = mmap(NULL, j->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        perror("journal mmap");
+        close(s->fd);
+        unlink(name);
+        return -1;
+    }
+    s->end = 0;
+    j->count++;
+    return 0;
+}
+
+static void segment_remove(stream_journal_t *j, stream_journal_segment_t *s) {
+    char name[1024];
+    munmap(s->map, j->segment_size);
+    close(s->fd);
+    segment_name(j, s->sequence, name, sizeof(name));
+    unlink(name);
+}
+
+stream_journal_t *stream_journal_open(const char *path, size_t segment_size, size_t cap) {
+    stream_journal_t *j = calloc(1, sizeof(stream_journal_t));
+    j->path = strdup(path);
+    j->segment_size = JOURNAL_ALIGN(segment_size);
+    j->max_segments = cap / j->segment_size;
+    if (j->max_segments < 1)
+        j->max_segments = 1;
+    j->segments = calloc(j->max_segments, sizeof(stream_journal_segment_t));
+    return j;
+}
+
+int stream_journal_append(stream_journal_t *j, stream_buffer_t *buf) {
+    size_t length = JOURNAL_ALIGN(buf->total_length);
+    if (length > j->segment_size)
+        return -1;
+    if (j->count == 0 || segment(j, j->count - 1)->end + length > j->segment_size) {
+        // A full segment that has been read is only retired by peek once there is a
+        // later one, with a cap of one segment that has to happen here.
+        if (j->count == 1 && j->read_offset == segment(j, 0)->end) {
+            segment_remove(j, segment(j, 0));
+            j->first = (j->first + 1) % j->max_segments;
+            j->count = 0;
+            j->read_offset = 0;
+        }
+        if (segment_add(j) < 0)
+            return -1;
+    }
+    stream_journal_segment_t *s = segment(j, j->count - 1);
+    memcpy(s->map + s->end, buf, buf->total_length);
+    s->end += length;
+    j->records++;
+    j->bytes += buf->total_length;
+    return 0;
+}
+
+stream_buffer_t *stream_journal_peek(stream_journal_t *j) {
+    while (j->count > 0) {
+        stream_journal_segment_t *s = segment(j, 0);
+        if (j->read_offset < s->end)
+            return (stream_buffer_t *) (s->map + j->read_offset);
+        // Everything in the last segment has been read, keep writing into it
+        if (j->count == 1)
+            return NULL;
+        segment_remove(j, s);
+        j->first = (j->first + 1) % j->max_segments;
+        j->count--;
+        j->read_offset = 0;
+    }
+    return NULL;
+}
+
+void stream_journal_next(stream_journal_t *j) {
+    stream_buffer_t *buf = stream_journal_peek(j);
+    if (buf == NULL)
+        return;
+    j->records--;
+    j->bytes -= buf->total_length;
+    j->read_offset += JOURNAL_ALIGN(buf->total_length);
+}
+
+void stream_journal_close(stream_journal_t *j) {
+    while (j->count > 0) {
+        segment_remove(j, segment(j, 0));
+        j->first = (j->first + 1) % j->max_segments;
+        j->count--;
+    }
+    free(j->segments);
+    free(j->path);
+    free(j);
+}
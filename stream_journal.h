@@ -0,0 +1,65 @@
+/*
+ * stream_journal.h
+ *
+ * Append-only spill journal for the router. Records are copied into memory mapped
+ * segment files of a fixed size, exactly as they sit in memory: a stream_buffer_t
+ * header followed by total_length - sizeof(stream_buffer_t) bytes of payload. Each
+ * record starts total_length bytes after the one before, as in a recording, and the
+ * unused tail of a segment is zero, so a segment left behind by a crash can be read by
+ * walking total_length until it is 0.
+ *
+ * Records are read back in the order they were written and a segment file is
+ * deleted once everything in it has been read. The journal does no locking of its
+ * own, the caller serialises append, peek and next.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream_tools.h"
+
+#ifndef STREAM_JOURNAL_H_
+#define STREAM_JOURNAL_H_
+
+typedef struct stream_journal_segment {
+    int fd;
+    uint8_t *map;
+    // Bytes written, the read side stops here
+    size_t end;
+    uint64_t sequence;
+} stream_journal_segment_t;
+
+typedef struct stream_journal {
+    char *path;
+    size_t segment_size;
+    // Segments in use are a ring, first is the one being read, last the one being written
+    stream_journal_segment_t *segments;
+    int max_segments;
+    int first;
+    int count;
+    size_t read_offset;
+    uint64_t next_sequence;
+    // Records and bytes written but not yet read
+    uint64_t records;
+    uint64_t bytes;
+} stream_journal_t;
+
+// Segment files are called <path>-<sequence>.journal. At most cap bytes of segments,
+// rounded down to whole segments and never less than one, are on disk at a time.
+stream_journal_t *stream_journal_open(const char *path, size_t segment_size, size_t cap);
+
+// Copy buf to the end of the journal. Returns -1 if the journal is full or the
+// record can't be written.
+int stream_journal_append(stream_journal_t *j, stream_buffer_t *buf);
+
+// Oldest record not yet read, NULL if there is none. It points into the segment
+// mapping and stays valid until stream_journal_next.
+stream_buffer_t *stream_journal_peek(stream_journal_t *j);
+
+// Done with the record returned by stream_journal_peek
+void stream_journal_next(stream_journal_t *j);
+
+// Unmap and delete every segment, records not yet read are lost
+void stream_journal_close(stream_journal_t *j);
+
+#endif /* STREAM_JOURNAL_H_ */
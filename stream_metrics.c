@@ -0,0 +1,177 @@
+/*
+ * stream_metrics.c
+ *
+ * See stream_metrics.h
+ */
+
+#define _GNU_SOURCE
+
+#include "stream_metrics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+void stream_metrics_printf(stream_metrics_text_t *text, const char *format, ...) {
+    va_list args;
+    for (;;) {
+        size_t room = text->size - text->length;
+        va_start(args, format);
+        int n = vsnprintf(text->data + text->length, room, format, args);
+        va_end(args);
+        if (n < 0)
+            return;
+        if ((size_t) n < room) {
+            text->length += n;
+            return;
+        }
+        text->size = text->size ? 2 * text->size + n : 65536;
+        text->data = realloc(text->data, text->size);
+    }
+}
+
+void stream_metrics_header(stream_metrics_text_t *text, const char *name, const char *type, const char *help) {
+    stream_metrics_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// MSG_NOSIGNAL so a scraper that hangs up mid-response can't SIGPIPE the whole process
+static int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Answer one request. Scrapers send a GET and wait, so the request is read up to the
+// blank line that ends its headers and then ignored.
+static void serve(stream_metrics_t *m, int fd) {
+    char request[4096], header[256];
+    size_t got = 0;
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    while (got < sizeof(request) - 1) {
+        ssize_t n = read(fd, request + got, sizeof(request) - 1 - got);
+        if (n <= 0)
+            return;
+        got += n;
+        request[got] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+            break;
+    }
+    m->text.length = 0;
+    m->render(&m->text, m->arg);
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long) m->text.length);
+    if (write_all(fd, header, n) == 0 && strncmp(request, "HEAD ", 5) != 0)
+        write_all(fd, m->text.data, m->text.length);
+}
+
+static void *metrics_thread(void *arg) {
+    stream_metrics_t *m = (stream_metrics_t *) arg;
+    // Scrapes wait rather than take a core from the data path
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    for (;;) {
+        int fd = accept(m->socket, NULL, NULL);
+        if (fd < 0) {
+            // Out of descriptors or some other lasting failure, don't spin on it
+            if (errno != EINTR && errno != ECONNABORTED)
+                sleep(1);
+            continue;
+        }
+        serve(m, fd);
+        close(fd);
+    }
+    return (NULL);
+}
+
+static int listen_unix(stream_metrics_t *m, const char *path) {
+    struct sockaddr_un sun;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        printf("Metrics socket path %s is too long\n", path);
+        return -1;
+    }
+    m->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (m->socket < 0)
+        return -1;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    // Left behind by an earlier run
+    unlink(path);
+    if (bind(m->socket, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+        printf("Can't serve metrics on %s -> ", path);
+        perror("bind");
+        return -1;
+    }
+    m->unix_path = strdup(path);
+    return 0;
+}
+
+static int listen_tcp(stream_metrics_t *m, const char *endpoint) {
+    char host[256] = "127.0.0.1";
+    const char *port = endpoint;
+    const char *colon = strrchr(endpoint, ':');
+    struct addrinfo hints, *ai;
+    int one = 1;
+    if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int) (colon - endpoint), endpoint);
+        port = colon + 1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(strcmp(host, "*") == 0 ? NULL : host, port, &hints, &ai) != 0) {
+        printf("Can't serve metrics on %s, bad address\n", endpoint);
+        return -1;
+    }
+    m->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (m->socket < 0) {
+        freeaddrinfo(ai);
+        return -1;
+    }
+    setsockopt(m->socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    int result = bind(m->socket, ai->ai_addr, ai->ai_addrlen);
+    freeaddrinfo(ai);
+    if (result < 0) {
+        printf("Can't serve metrics on %s -> ", endpoint);
+        perror("bind");
+        return -1;
+    }
+    return 0;
+}
+
+stream_metrics_t *stream_metrics_start(const char *endpoint, stream_metrics_render_t render, void *arg) {
+    stream_metrics_t *m = calloc(1, sizeof(stream_metrics_t));
+    m->render = render;
+    m->arg = arg;
+    m->socket = -1;
+    int result = strchr(endpoint, '/') != NULL ? listen_unix(m, endpoint) : listen_tcp(m, endpoint);
+    if (result < 0 || listen(m->socket, 16) < 0) {
+        if (m->socket >= 0)
+            close(m->socket);
+        free(m->unix_path);
+        free(m);
+        return NULL;
+    }
+    pthread_create(&m->thread, NULL, metrics_thread, m);
+    pthread_detach(m->thread);
+    return m;
+}
@@ -0,0 +1,49 @@
+/*
+ * stream_metrics.h
+ *
+ * A small read-only HTTP endpoint for Prometheus style text metrics. A thread of its
+ * own, running at the lowest priority, accepts one connection at a time and answers
+ * every request with whatever the render callback writes, so the threads that move
+ * data never do any of the formatting. It listens on TCP, by default on the loopback
+ * interface only, or on a Unix socket, e.g.
+ *
+ *   curl http://127.0.0.1:9100/metrics
+ *   curl --unix-socket /tmp/router.sock http://localhost/metrics
+ */
+
+#include <stddef.h>
+#include <pthread.h>
+
+#ifndef STREAM_METRICS_H_
+#define STREAM_METRICS_H_
+
+// Text being rendered, grows as needed
+typedef struct stream_metrics_text {
+    char *data;
+    size_t length;
+    size_t size;
+} stream_metrics_text_t;
+
+typedef void (*stream_metrics_render_t)(stream_metrics_text_t *text, void *arg);
+
+typedef struct stream_metrics {
+    int socket;
+    char *unix_path;
+    stream_metrics_render_t render;
+    void *arg;
+    pthread_t thread;
+    stream_metrics_text_t text;
+} stream_metrics_t;
+
+// Serve on endpoint, which is a port, host:port or, if it contains a '/', the path of
+// a Unix socket. Returns NULL if it can't be bound.
+stream_metrics_t *stream_metrics_start(const char *endpoint, stream_metrics_render_t render, void *arg);
+
+// printf onto the end of text
+void stream_metrics_printf(stream_metrics_text_t *text, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// The # HELP and # TYPE lines that come before a metric's samples
+void stream_metrics_header(stream_metrics_text_t *text, const char *name, const char *type, const char *help);
+
+#endif /* STREAM_METRICS_H_ */
@@ -0,0 +1,396 @@
+/*
+ * stream_queue_bench.c
+ *
+ * Microbenchmark and stress test for the stream_tools queues. Every configuration is run
+ * for each queue size and wait strategy given and reports operations per second and the
+ * time items spend in the queue, sampled every LATENCY_SAMPLE items.
+ *
+ *   1p1c-spsc  one producer, one consumer, STREAM_QUEUE_SPSC
+ *   1p1c-mpsc  one producer, one consumer, STREAM_QUEUE_MPSC
+ *   np1c-mpsc  -P producers, one consumer, STREAM_QUEUE_MPSC
+ *   npmc-evict -P producers, -C consumers. A queue has a single consumer by design, the
+ *              nearest thing to several is an MPSC queue with stream_queue_allow_evict,
+ *              where whoever takes from the consumer side does it under the consumer
+ *              lock. That is the path the router's drop-oldest policy uses.
+ *
+ * Every item carries its producer and sequence number. Consumers check that each
+ * producer's items reach them in order, and at the end that as many arrived as were
+ * sent with the same checksum. With -x every item is also marked off in a bitmap so a
+ * lost or duplicated item is found exactly, and the runs are repeated with random batch
+ * sizes to shake out races. The exit status is 1 if any check failed.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stream_tools.h"
+
+// Items are (producer + 1) << ITEM_SHIFT | sequence so they are never NULL, and
+// STOP, producer 0, tells a consumer to finish.
+#define ITEM_SHIFT 40
+#define ITEM_STOP ((void *) 1)
+#define MAX_THREADS 64
+// Queue latency is measured on one item in this many
+#define LATENCY_SAMPLE 64
+
+typedef enum config {
+    CONFIG_1P1C_SPSC = 0,
+    CONFIG_1P1C_MPSC,
+    CONFIG_NP1C_MPSC,
+    CONFIG_NPMC_EVICT,
+    CONFIG_COUNT
+} config_t;
+
+static const char *config_names[] = {"1p1c-spsc", "1p1c-mpsc", "np1c-mpsc", "npmc-evict"};
+
+// Set by the command line
+uint64_t total_items = 10000000;
+int producer_count = 4;
+int consumer_count = 2;
+int batch = 1;
+int stress = 0;
+// Runs of each combination, set by -r. Without it 1, or 10 with -x
+int repeats = 0;
+int run_config[CONFIG_COUNT] = {1, 1, 1, 1};
+
+typedef struct run {
+    stream_rb_t *queue;
+    int producers;
+    int consumers;
+    uint64_t per_producer;
+    // Producer p stamps item s in sent[p][s / LATENCY_SAMPLE] before queueing it
+    struct timespec *sent[MAX_THREADS];
+    // With -x, bit s of seen[p] is set when item s of producer p arrives
+    _Atomic uint64_t *seen[MAX_THREADS];
+    _Atomic uint64_t received;
+    _Atomic uint64_t checksum;
+    _Atomic uint64_t errors;
+    // Extra STOP items a consumer took in a batch and put back
+    _Atomic int stops_returned;
+} run_t;
+
+typedef struct worker {
+    run_t *run;
+    int index;
+    pthread_t thread;
+    unsigned seed;
+    stream_hist_t latency;
+} worker_t;
+
+static inline uint64_t item_value(int producer, uint64_t sequence) {
+    return ((uint64_t) (producer + 1) << ITEM_SHIFT) | sequence;
+}
+
+static inline int64_t ns_between(struct timespec *from, struct timespec *to) {
+    return (int64_t) (to->tv_sec - from->tv_sec) * 1000000000 + (to->tv_nsec - from->tv_nsec);
+}
+
+// Batch for the next call, random from 1 to -b with -x
+static inline int next_batch(worker_t *w) {
+    return stress && batch > 1 ? 1 + rand_r(&w->seed) % batch : batch;
+}
+
+void *producer_thread(void *arg) {
+    worker_t *w = (worker_t *) arg;
+    run_t *r = w->run;
+    void *values[256];
+    uint64_t s = 0;
+    while (s < r->per_producer) {
+        int i, n = next_batch(w);
+        if (n > r->per_producer - s)
+            n = r->per_producer - s;
+        for (i = 0; i < n; i++, s++) {
+            if (s % LATENCY_SAMPLE == 0)
+                clock_gettime(CLOCK_MONOTONIC, &r->sent[w->index][s / LATENCY_SAMPLE]);
+            values[i] = (void *) (uintptr_t) item_value(w->index, s);
+        }
+        if (n == 1)
+            stream_queue_add(r->queue, values[0]);
+        else
+            stream_queue_add_batch(r->queue, values, n);
+    }
+    return (NULL);
+}
+
+void *consumer_thread(void *arg) {
+    worker_t *w = (worker_t *) arg;
+    run_t *r = w->run;
+    void *values[256];
+    // Next sequence expected from each producer, items from one producer stay in order
+    // however many consumers share them
+    uint64_t next[MAX_THREADS];
+    uint64_t received = 0, checksum = 0, errors = 0;
+    int stops = 0;
+    memset(next, 0, sizeof(next));
+    while (stops == 0) {
+        int i, n = stream_queue_get_batch(r->queue, values, next_batch(w));
+        struct timespec now;
+        for (i = 0; i < n; i++) {
+            if (values[i] == ITEM_STOP) {
+                stops++;
+                continue;
+            }
+            uint64_t v = (uint64_t) (uintptr_t) values[i];
+            int p = (int) (v >> ITEM_SHIFT) - 1;
+            uint64_t s = v & ((1ULL << ITEM_SHIFT) - 1);
+            if (p < 0 || p >= r->producers || s < next[p] || s >= r->per_producer) {
+                if (errors++ < 10)
+                    printf("\tconsumer %d: item %lx out of order, expected %lu from producer %d\n",
+                           w->index, (unsigned long) v, (unsigned long) (p >= 0 && p < r->producers ? next[p] : 0), p);
+                continue;
+            }
+            if (r->consumers == 1 && s != next[p] && errors++ < 10)
+                printf("\tconsumer %d: producer %d items %lu to %lu missing\n", w->index, p,
+                       (unsigned long) next[p], (unsigned long) s - 1);
+            next[p] = s + 1;
+            if (s % LATENCY_SAMPLE == 0) {
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                stream_hist_record(&w->latency, ns_between(&r->sent[p][s / LATENCY_SAMPLE], &now));
+            }
+            if (stress) {
+                uint64_t bit = 1ULL << (s % 64);
+                if (atomic_fetch_or_explicit(&r->seen[p][s / 64], bit, memory_order_relaxed) & bit)
+                    if (errors++ < 10)
+                        printf("\tconsumer %d: producer %d item %lu arrived twice\n", w->index, p, (unsigned long) s);
+            }
+            received++;
+            checksum += v;
+        }
+    }
+    // Every consumer has to see a STOP of its own
+    while (stops-- > 1) {
+        atomic_fetch_add(&r->stops_returned, 1);
+        stream_queue_add(r->queue, ITEM_STOP);
+    }
+    atomic_fetch_add(&r->received, received);
+    atomic_fetch_add(&r->checksum, checksum);
+    atomic_fetch_add(&r->errors, errors);
+    return (NULL);
+}
+
+// One run of a configuration, prints a line of results. Returns the number of errors.
+uint64_t run_one(config_t config, int size, stream_wait_t wait, unsigned seed) {
+    run_t r;
+    worker_t producers[MAX_THREADS], consumers[MAX_THREADS];
+    stream_hist_t latency;
+    struct timespec start, end;
+    int i, p;
+    memset(&r, 0, sizeof(r));
+    r.producers = config == CONFIG_1P1C_SPSC || config == CONFIG_1P1C_MPSC ? 1 : producer_count;
+    r.consumers = config == CONFIG_NPMC_EVICT ? consumer_count : 1;
+    r.per_producer = total_items / r.producers;
+    r.queue = stream_queue_create(size, config == CONFIG_1P1C_SPSC ? STREAM_QUEUE_SPSC : STREAM_QUEUE_MPSC, wait);
+    if (config == CONFIG_NPMC_EVICT)
+        stream_queue_allow_evict(r.queue);
+    uint64_t expected_checksum = 0;
+    for (p = 0; p < r.producers; p++) {
+        r.sent[p] = calloc(r.per_producer / LATENCY_SAMPLE + 1, sizeof(struct timespec));
+        if (stress)
+            r.seen[p] = calloc(r.per_producer / 64 + 1, sizeof(uint64_t));
+        // sum of item_value(p, s) for s in [0, per_producer)
+        expected_checksum += r.per_producer * ((uint64_t) (p + 1) << ITEM_SHIFT)
+                             + r.per_producer * (r.per_producer - 1) / 2;
+    }
+    memset(consumers, 0, sizeof(consumers));
+    memset(producers, 0, sizeof(producers));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < r.consumers; i++) {
+        consumers[i].run = &r;
+        consumers[i].index = i;
+        consumers[i].seed = seed + 1000 + i;
+        pthread_create(&consumers[i].thread, NULL, consumer_thread, &consumers[i]);
+    }
+    for (i = 0; i < r.producers; i++) {
+        producers[i].run = &r;
+        producers[i].index = i;
+        producers[i].seed = seed + i;
+        pthread_create(&producers[i].thread, NULL, producer_thread, &producers[i]);
+    }
+    for (i = 0; i < r.producers; i++)
+        pthread_join(producers[i].thread, NULL);
+    // All the items are queued, the STOPs go in behind them
+    for (i = 0; i < r.consumers; i++)
+        stream_queue_add(r.queue, ITEM_STOP);
+    memset(&latency, 0, sizeof(latency));
+    for (i = 0; i < r.consumers; i++) {
+        pthread_join(consumers[i].thread, NULL);
+        stream_hist_merge(&latency, &consumers[i].latency);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t sent = r.per_producer * r.producers;
+    uint64_t errors = atomic_load(&r.errors);
+    if (atomic_load(&r.received) != sent) {
+        printf("\t%lu items received, %lu sent\n", (unsigned long) atomic_load(&r.received), (unsigned long) sent);
+        errors++;
+    }
+    else if (atomic_load(&r.checksum) != expected_checksum) {
+        printf("\tchecksum %lx, expected %lx\n", (unsigned long) atomic_load(&r.checksum),
+               (unsigned long) expected_checksum);
+        errors++;
+    }
+    if (stress) {
+        uint64_t s, missing = 0;
+        for (p = 0; p < r.producers; p++)
+            for (s = 0; s < r.per_producer; s++)
+                if (!(atomic_load_explicit(&r.seen[p][s / 64], memory_order_relaxed) & (1ULL << (s % 64))))
+                    missing++;
+        if (missing > 0) {
+            printf("\t%lu items never arrived\n", (unsigned long) missing);
+            errors++;
+        }
+    }
+    if (stream_queue_count(r.queue) != 0) {
+        printf("\t%d items left in the queue\n", stream_queue_count(r.queue));
+        errors++;
+    }
+
+    double seconds = ns_between(&start, &end) / 1e9;
+    printf("%-11s %7d %-6s %5dx%-2d %5d %10lu %8.3f %9.2f %9.0f %9.0f %9.0f %10.0f  %s\n",
+           config_names[config], (int) r.queue->size, stream_wait_name(wait), r.producers, r.consumers,
+           batch, (unsigned long) sent, seconds, sent / seconds / 1e6,
+           (double) stream_hist_percentile(&latency, 50.0), (double) stream_hist_percentile(&latency, 99.0),
+           (double) stream_hist_percentile(&latency, 99.9), (double) latency.max, errors ? "FAIL" : "ok");
+    fflush(stdout);
+    for (p = 0; p < r.producers; p++) {
+        free(r.sent[p]);
+        free(r.seen[p]);
+    }
+    stream_queue_destroy(r.queue);
+    return errors;
+}
+
+void print_usage(char *pname) {
+    printf("usage: %s [-n items] [-s sizes] [-w waits] [-c configs] [-P producers] [-C consumers] [-b batch] [-x [-r repeats]]\n", pname);
+    printf("\t-n <items>: items sent per run, shared between the producers [default: 10000000]\n");
+    printf("\t-s <sizes>: comma separated queue sizes, rounded up to powers of two [default: 16,1024,65536]\n");
+    printf("\t-w <waits>: comma separated wait strategies sleep|spin|yield|block [default: yield,block]\n");
+    printf("\t-c <configs>: comma separated from 1p1c-spsc, 1p1c-mpsc, np1c-mpsc, npmc-evict [default: all]\n");
+    printf("\t-P <producers>: producers for np1c and npmc [default: 4]\n");
+    printf("\t-C <consumers>: consumers for npmc [default: 2]\n");
+    printf("\t-b <batch>: items per add and most per get, with -x a random number up to this [default: 1]\n");
+    printf("\t-x: stress, check every item off in a bitmap and repeat each run\n");
+    printf("\t-r <repeats>: runs of each combination with -x [default: 10]\n");
+}
+
+int main(int argc, char **argv) {
+    char opt;
+    char *sizes = "16,1024,65536";
+    char *waits = "yield,block";
+    char *field, *save;
+    int i;
+    while ((opt = getopt(argc, argv, "n:s:w:c:P:C:b:xr:")) != -1) {
+        switch (opt) {
+            case 'n':
+                total_items = strtoull(optarg, NULL, 0);
+                if (total_items < 1 || total_items >= (1ULL << ITEM_SHIFT)) {
+                    printf("invalid number of items = %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 's':
+                sizes = strdup(optarg);
+                break;
+            case 'w':
+                waits = strdup(optarg);
+                break;
+            case 'c': {
+                char *copy = strdup(optarg);
+                memset(run_config, 0, sizeof(run_config));
+                for (field = strtok_r(copy, ",", &save); field != NULL; field = strtok_r(NULL, ",", &save)) {
+                    for (i = 0; i < CONFIG_COUNT; i++)
+                        if (strcmp(field, config_names[i]) == 0)
+                            break;
+                    if (i == CONFIG_COUNT) {
+                        printf("unknown configuration %s\n", field);
+                        exit(1);
+                    }
+                    run_config[i] = 1;
+                }
+                free(copy);
+                break;
+            }
+            case 'P':
+                producer_count = atoi(optarg);
+                if (producer_count < 1 || producer_count > MAX_THREADS) {
+                    printf("invalid number of producers = %s, must be 1 to %d.\n", optarg, MAX_THREADS);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                consumer_count = atoi(optarg);
+                if (consumer_count < 1 || consumer_count > MAX_THREADS) {
+                    printf("invalid number of consumers = %s, must be 1 to %d.\n", optarg, MAX_THREADS);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                if (batch < 1 || batch > 256) {
+                    printf("invalid batch = %s, must be 1 to 256.\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'x':
+                stress = 1;
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                if (repeats < 1) {
+                    printf("invalid number of repeats = %s, must be > 0.\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(1);
+        }
+    }
+    if (repeats == 0)
+        repeats = stress ? 10 : 1;
+    // Latency is in ns, the time from a producer stamping an item to a consumer taking it
+    printf("%-11s %7s %-6s %8s %5s %10s %8s %9s %9s %9s %9s %10s\n", "config", "size", "wait", "threads",
+           "batch", "items", "seconds", "Mops/s", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+    uint64_t errors = 0;
+    unsigned seed = (unsigned) time(NULL);
+    char *size_list = strdup(sizes);
+    char *size_save, *size_field;
+    for (size_field = strtok_r(size_list, ",", &size_save); size_field != NULL;
+         size_field = strtok_r(NULL, ",", &size_save)) {
+        int size = atoi(size_field);
+        if (size < 1) {
+            printf("invalid queue size = %s\n", size_field);
+            exit(1);
+        }
+        char *wait_list = strdup(waits);
+        char *wait_save, *wait_field;
+        for (wait_field = strtok_r(wait_list, ",", &wait_save); wait_field != NULL;
+             wait_field = strtok_r(NULL, ",", &wait_save)) {
+            int wait = stream_wait_from_name(wait_field);
+            if (wait < 0) {
+                printf("invalid wait strategy = %s\n", wait_field);
+                exit(1);
+            }
+            for (i = 0; i < CONFIG_COUNT; i++) {
+                int k;
+                if (!run_config[i])
+                    continue;
+                for (k = 0; k < (stress ? repeats : 1); k++)
+                    errors += run_one(i, size, wait, seed++ * 7919);
+            }
+        }
+        free(wait_list);
+    }
+    free(size_list);
+    if (errors > 0) {
+        printf("\n%lu errors\n", (unsigned long) errors);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * stream_recorder.c
+ *
+ * See stream_recorder.h
+ */
+
+#define _GNU_SOURCE
+
+#include "stream_recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ALIGN_DOWN(n) ((n) & ~(size_t) (STREAM_RECORDER_ALIGN - 1))
+#define ALIGN_UP(n) ALIGN_DOWN((n) + STREAM_RECORDER_ALIGN - 1)
+
+// Open data and index file number r->file_number
+static int file_open(stream_recorder_t *r) {
+    char name[1024];
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    snprintf(name, sizeof(name), "%s-%d.dat", r->prefix, r->file_number);
+    r->fd = -1;
+    if (r->direct) {
+        r->fd = open(name, flags | O_DIRECT, 0644);
+        if (r->fd < 0 && errno == EINVAL) {
+            printf("%s can't be written O_DIRECT, using the page cache\n", name);
+            r->direct = 0;
+        }
+    }
+    if (r->fd < 0)
+        r->fd = open(name, flags, 0644);
+    if (r->fd < 0) {
+        printf("Error opening file %s -> ", name);
+        perror("open");
+        return -1;
+    }
+    snprintf(name, sizeof(name), "%s-%d.idx", r->prefix, r->file_number);
+    r->index_file = fopen(name, "w");
+    if (r->index_file == NULL) {
+        printf("Error opening file %s -> ", name);
+        perror("fopen");
+        close(r->fd);
+        return -1;
+    }
+    r->files++;
+    return 0;
+}
+
+static int file_close(stream_recorder_t *r, uint64_t size) {
+    int result = 0;
+    // The last block was padded out for O_DIRECT, cut the file back to what was recorded
+    if (r->direct && ftruncate(r->fd, size) < 0) {
+        perror("recorder ftruncate");
+        result = -1;
+    }
+    if (close(r->fd) < 0 || fclose(r->index_file) != 0)
+        result = -1;
+    return result;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("recorder write");
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static void *writer_thread(void *arg) {
+    stream_recorder_t *r = (stream_recorder_t *) arg;
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        while (r->pending == NULL)
+            pthread_cond_wait(&r->ready, &r->lock);
+        stream_recorder_buffer_t *b = r->pending;
+        pthread_mutex_unlock(&r->lock);
+        int error = 0;
+        if (write_all(r->fd, b->data, b->length) < 0)
+            error = 1;
+        if (fwrite(b->index, sizeof(stream_index_entry_t), b->index_count, r->index_file) != b->index_count)
+            error = 1;
+        if (b->rotate) {
+            if (file_close(r, b->file_size) < 0)
+                error = 1;
+            r->file_number++;
+            if (!b->last && file_open(r) < 0)
+                error = 1;
+        }
+        int last = b->last;
+        pthread_mutex_lock(&r->lock);
+        if (error)
+            r->error = 1;
+        r->pending = NULL;
+        pthread_cond_signal(&r->done);
+        pthread_mutex_unlock(&r->lock);
+        if (last || error)
+            break;
+    }
+    return (NULL);
+}
+
+// Hand the fill buffer to the writer and carry on in the other one. Unless the file ends
+// here only whole blocks are written, the tail moves to the front of the next buffer.
+static int hand_over(stream_recorder_t *r, int rotate, int last) {
+    stream_recorder_buffer_t *b = r->fill;
+    stream_recorder_buffer_t *next = b == &r->buffers[0] ? &r->buffers[1] : &r->buffers[0];
+    pthread_mutex_lock(&r->lock);
+    while (r->pending != NULL)
+        pthread_cond_wait(&r->done, &r->lock);
+    int error = r->error;
+    pthread_mutex_unlock(&r->lock);
+    if (error)
+        return -1;
+    b->rotate = rotate;
+    b->last = last;
+    b->file_size = r->file_bytes;
+    if (rotate) {
+        b->length = r->direct ? ALIGN_UP(b->used) : b->used;
+        memset(b->data + b->used, 0, b->length - b->used);
+        next->used = 0;
+        r->file_bytes = 0;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &r->file_opened);
+    }
+    else {
+        b->length = r->direct ? ALIGN_DOWN(b->used) : b->used;
+        next->used = b->used - b->length;
+        memcpy(next->data, b->data + b->length, next->used);
+    }
+    next->index_count = 0;
+    pthread_mutex_lock(&r->lock);
+    r->pending = b;
+    pthread_cond_signal(&r->ready);
+    pthread_mutex_unlock(&r->lock);
+    r->fill = next;
+    return 0;
+}
+
+stream_recorder_t *stream_recorder_open(const char *prefix, size_t buffer_size, uint64_t rotate_bytes,
+                                        int rotate_seconds, int direct) {
+    int i;
+    stream_recorder_t *r = calloc(1, sizeof(stream_recorder_t));
+    r->prefix = strdup(prefix);
+    r->buffer_size = ALIGN_UP(buffer_size);
+    r->rotate_bytes = rotate_bytes;
+    r->rotate_seconds = rotate_seconds;
+    r->direct = direct;
+    // Every record is at least a header
+    r->index_capacity = r->buffer_size / sizeof(stream_buffer_t) + 1;
+    for (i = 0; i < 2; i++) {
+        // Room for a carried over tail plus padding to a whole block
+        if (posix_memalign((void **) &r->buffers[i].data, STREAM_RECORDER_ALIGN,
+                           r->buffer_size + 2 * STREAM_RECORDER_ALIGN) != 0)
+            return NULL;
+        r->buffers[i].index = malloc(r->index_capacity * sizeof(stream_index_entry_t));
+    }
+    r->fill = &r->buffers[0];
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->ready, NULL);
+    pthread_cond_init(&r->done, NULL);
+    if (file_open(r) < 0)
+        return NULL;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &r->file_opened);
+    pthread_create(&r->writer, NULL, writer_thread, r);
+    return r;
+}
+
+int stream_recorder_write(stream_recorder_t *r, const stream_buffer_t *buf, size_t length) {
+    if (length > r->buffer_size)
+        return -1;
+    if (r->file_bytes > 0) {
+        int rotate = r->rotate_bytes > 0 && r->file_bytes + length > r->rotate_bytes;
+        if (!rotate && r->rotate_seconds > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+            rotate = now.tv_sec - r->file_opened.tv_sec >= r->rotate_seconds;
+        }
+        if (rotate && hand_over(r, TRUE, FALSE) < 0)
+            return -1;
+    }
+    stream_recorder_buffer_t *b = r->fill;
+    if (b->used + length > r->buffer_size || b->index_count == r->index_capacity) {
+        if (hand_over(r, FALSE, FALSE) < 0)
+            return -1;
+        b = r->fill;
+    }
+    stream_index_entry_t *e = &b->index[b->index_count++];
+    e->source_id = buf->source_id;
+    e->total_length = length;
+    e->record_counter = buf->record_counter;
+    e->tv_sec = buf->timestamp.tv_sec;
+    e->tv_nsec = buf->timestamp.tv_nsec;
+    e->offset = r->file_bytes;
+    memcpy(b->data + b->used, buf, length);
+    b->used += length;
+    r->file_bytes += length;
+    r->records++;
+    r->bytes += length;
+    return 0;
+}
+
+int stream_recorder_close(stream_recorder_t *r) {
+    int i, result = hand_over(r, TRUE, TRUE);
+    // The writer stops after the last buffer or its first error
+    pthread_join(r->writer, NULL);
+    if (r->error)
+        result = -1;
+    for (i = 0; i < 2; i++) {
+        free(r->buffers[i].data);
+        free(r->buffers[i].index);
+    }
+    free(r->prefix);
+    free(r);
+    return result;
+}
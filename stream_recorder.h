@@ -0,0 +1,94 @@
+/*
+ * stream_recorder.h
+ *
+ * Records whole stream records to disk at disk speed. Records are copied into one of two
+ * large page aligned buffers while a writer thread writes the other, so the caller only
+ * pays for a memcpy and the disk sees a few large writes. Files can be opened O_DIRECT to
+ * keep the page cache out of the way, and are rotated by size or age.
+ *
+ * Data files are called <prefix>-<n>.dat and hold the records back to back exactly as
+ * they were received, stream_buffer_t header and payload. Next to each one <prefix>-<n>.idx
+ * holds a stream_index_entry_t per record giving where in the data file it starts.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "stream_tools.h"
+
+#ifndef STREAM_RECORDER_H_
+#define STREAM_RECORDER_H_
+
+// O_DIRECT needs the buffer address, the file offset and the length all aligned to this
+#define STREAM_RECORDER_ALIGN 4096
+
+typedef struct stream_index_entry {
+    uint32_t source_id;
+    uint32_t total_length;
+    uint64_t record_counter;
+    int64_t tv_sec;
+    int64_t tv_nsec;
+    // Byte offset of the record in the data file
+    uint64_t offset;
+} stream_index_entry_t;
+
+typedef struct stream_recorder_buffer {
+    uint8_t *data;
+    size_t used;
+    // Bytes the writer writes, less than used when the tail waits for the next buffer
+    size_t length;
+    stream_index_entry_t *index;
+    int index_count;
+    // The data file ends with this buffer, it is file_size bytes long
+    int rotate;
+    int last;
+    uint64_t file_size;
+} stream_recorder_buffer_t;
+
+typedef struct stream_recorder {
+    char *prefix;
+    size_t buffer_size;
+    int index_capacity;
+    uint64_t rotate_bytes;
+    int rotate_seconds;
+    int direct;
+    stream_recorder_buffer_t buffers[2];
+    // The one being filled, the other belongs to the writer while pending is set
+    stream_recorder_buffer_t *fill;
+    stream_recorder_buffer_t *pending;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t done;
+    pthread_t writer;
+    int error;
+    // Written by the writer thread only
+    int fd;
+    FILE *index_file;
+    int file_number;
+    // Filling side
+    uint64_t file_bytes;
+    struct timespec file_opened;
+    // Statistics
+    uint64_t records;
+    uint64_t bytes;
+    int files;
+} stream_recorder_t;
+
+// Start recording to <prefix>-0.dat. buffer_size is rounded up to STREAM_RECORDER_ALIGN and
+// is also the largest record that can be written. A new file is started once the current
+// one has rotate_bytes in it or is rotate_seconds old, 0 turns either off. If direct is
+// set the files are opened O_DIRECT when the file system allows it.
+// Returns NULL if the first file can't be created.
+stream_recorder_t *stream_recorder_open(const char *prefix, size_t buffer_size, uint64_t rotate_bytes,
+                                        int rotate_seconds, int direct);
+
+// Copy a record of length bytes. Returns -1 if it is too big or a write has failed.
+int stream_recorder_write(stream_recorder_t *r, const stream_buffer_t *buf, size_t length);
+
+// Write out what is buffered, close the files and free the recorder.
+// Returns -1 if any write failed.
+int stream_recorder_close(stream_recorder_t *r);
+
+#endif /* STREAM_RECORDER_H_ */
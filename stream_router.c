@@ -1,15 +1,20 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 // #include <mpi.h>
@@ -18,188 +23,1985 @@
 #include "czmq.h"
 
 #include "stream_tools.h"
+#include "stream_uring.h"
+#include "stream_codec.h"
+#include "stream_journal.h"
+#include "stream_metrics.h"
 
 int do_delay = 0;
 int do_debug = 0;
 int do_stats = 0;
+// Latency from the record timestamp at ingest and publish, set by -l
+int do_latency = 0;
+#define LATENCY_INTERVAL 10
+// Metrics endpoint, set by -E
+char *metrics_endpoint = NULL;
 int worker_threads = 1;
+int epoll_mode = 0;
 int keep_going = 1;
 int zmq_mode = 0;
 int mpi_mode = 0;
 int server_socket;
 char *publisher = "tcp://*:5556";
-void *out_queue;
-void *publish_socket;
+// Output is sharded by source ID, each output thread has its own queue and publish socket
+int output_thread_count = 1;
+int out_queue_depth = 100;
+
+// Time frame builder, set by -F or -N. Records from every source are grouped by timestamp
+// or record_counter into frames and each frame is published as one multipart message.
+typedef enum frame_key {
+    FRAME_OFF = 0,
+    FRAME_BY_TIME,
+    FRAME_BY_COUNTER
+} frame_key_t;
+frame_key_t frame_key = FRAME_OFF;
+// Nanoseconds or records per frame
+uint64_t frame_window;
+// An open frame is published anyway this long after its first record arrived
+int frame_timeout_ms = 100;
+// What to do with a frame that times out with sources missing, publish it or drop it
+int frame_drop_incomplete = 0;
+stream_rb_t *frame_queue;
 // TCP receive buffer size in bytes, 0 = default
 int rcvBufSize = 0;
+// How threads wait on the output queues, see stream_wait_t
+stream_wait_t wait_strategy = STREAM_WAIT_SLEEP;
+// Free buffers kept per size class in each connection's pool, 0 = malloc every record
+int pool_depth = 32;
+
+// Bytes staged per connection so that one read() picks up as many records as are waiting
+int staging_size = 256 * 1024;
+
+// Codec stage, set by -c. Records are published compressed with publish_codec,
+// STREAM_CODEC_NONE publishes raw payloads. Without -c records pass through untouched.
+int do_codec = 0;
+stream_codec_t publish_codec = STREAM_CODEC_NONE;
+int publish_level = STREAM_CODEC_DEFAULT_LEVEL;
+int codec_thread_count = 4;
+
+// Incoming data is read in large chunks into a staging buffer, data[start..end) has been
+// read from the socket but not yet consumed.
+typedef struct stream_reader {
+    uint8_t *data;
+    size_t size;
+    size_t start;
+    size_t end;
+} stream_reader_t;
+
+// Where a connection is in the protocol, so that parsing can stop whenever the staged data
+// runs out and carry on when more arrives.
+typedef enum connection_state {
+    CONN_MAGIC = 0,
+    CONN_ID,
+    CONN_HEADER,
+    CONN_BODY,
+    CONN_CLOSED
+} connection_state_t;
 
 typedef struct worker_thread_context {
     char name[64];
     int socket;
     pthread_t thread;
     void *zmq_context;
+    stream_pool_t *pool;
+    stream_reader_t reader;
+    connection_state_t state;
+    uint32_t source_id;
+    // Record being filled in CONN_BODY, if we close and buf != NULL it must go back to the pool.
+    stream_buffer_t *buf;
+    uint32_t filled;
+    // Statistics, written by the connection's thread and read by the stats and metrics threads
+    _Atomic uint64_t records;
+    _Atomic uint64_t bytes;
+    stream_sequence_t sequence;
+    stream_latency_t *latency;
+    // Set under connections_lock once the latency summary was printed at exit
+    int summarised;
+    // Clock read for the records parsed from the current read
+    struct timespec now;
+    int stamped;
+    // On the connections list once the source ID is known
+    int registered;
+    struct worker_thread_context *next;
+    // Only used by the stats thread
+    struct timespec tStart;
+    uint64_t last_records;
+    uint64_t last_bytes;
 } worker_thread_context_t;
 
-void buf_free(void *buf) {
-    // Buffer was allocated with Malloc(), free it with free()
+// Every connection with a known source, for the stats and metrics threads. A connection
+// leaves the list before it is freed.
+worker_thread_context_t *connections;
+int connection_count;
+pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Add to a counter that only the calling thread writes. Other threads may read it at any
+// time but there is no need for a locked read-modify-write.
+static inline void counter_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+// ZMQ free callback. Once a buffer has been handed to zmq_msg_init_data ZMQ owns it
+// and calls this, possibly from its I/O thread, when the message has been sent.
+void buf_free(void *data, void *hint) {
+    // Buffer came from a connection's pool, give it back
     if (do_debug > 0)
         printf("call free\n");
-    free(buf);
+    stream_pool_put(data);
 }
 
-void *output_thread(void *arg) {
-    printf("Output thread starts -------\n");
+void print_pool_stats(worker_thread_context_t *ctx) {
+    if (ctx->pool == NULL)
+        return;
+    printf("ID %s - pool hits %lu, misses %lu, high water %d buffers\n", ctx->name,
+           (unsigned long) atomic_load(&ctx->pool->hits), (unsigned long) atomic_load(&ctx->pool->misses),
+           atomic_load(&ctx->pool->high_water));
+}
+
+// What a stage does with a record when the queue to the next stage is full, set by -D.
+// block waits for room and pushes back on the sources, the drop policies keep the
+// stage moving and count what they threw away, spill writes to a journal on disk
+// that is replayed into the queue as it empties.
+typedef enum overflow_policy {
+    OVERFLOW_BLOCK = 0,
+    OVERFLOW_DROP_NEWEST,
+    OVERFLOW_DROP_OLDEST,
+    OVERFLOW_SPILL
+} overflow_policy_t;
+
+static const char *overflow_names[] = {"block", "drop-newest", "drop-oldest", "spill"};
+
+// Spill journals, set by -J and -j. Each queue of a spilling stage gets its own journal,
+// <journal_path>-<stage>-<queue>-<sequence>.journal, and the cap is shared between them.
+char *journal_path = NULL;
+size_t journal_cap = 1024UL * 1024 * 1024;
+size_t journal_queue_cap;
+#define JOURNAL_SEGMENT (64UL * 1024 * 1024)
+
+#define STAGE_MAX_SOURCES 256
+// Queue occupancy is sampled once every STAGE_SAMPLE records into power of two bins,
+// bin 0 is an empty queue and bin k holds 2^(k-1) to 2^k - 1 records.
+#define STAGE_SAMPLE 16
+#define STAGE_BINS 18
+
+typedef struct stage_source {
+    // source ID with bit 32 set once the slot is taken
+    _Atomic uint64_t key;
+    _Atomic uint64_t records;
+    _Atomic uint64_t bytes;
+} stage_source_t;
+
+struct stage;
+
+// One of the queues a stage feeds. With the spill policy, once a record has gone to the
+// journal every later one follows it there until the replay thread has caught up, so
+// records from a source stay in order.
+typedef struct stage_lane {
+    struct stage *stage;
+    int index;
+    stream_rb_t *queue;
+    // NULL once the journal is closed at shutdown, records that would spill are dropped
+    stream_journal_t *journal;
+    pthread_t replay;
+    // Serialises the journal between the producers and the replay thread
+    pthread_mutex_t lock;
+    // Records in the journal, including the one the replay thread is holding
+    _Atomic uint64_t pending;
+} stage_lane_t;
+
+// The hand-over into a set of queues, the codec threads' or the output side's. Drops are
+// counted since the start, occupancy since the last report.
+typedef struct stage {
+    const char *name;
+    overflow_policy_t policy;
+    stage_lane_t **lanes;
+    int lane_count;
+    _Atomic uint64_t dropped;
+    _Atomic uint64_t dropped_bytes;
+    _Atomic uint64_t spilled;
+    _Atomic uint64_t replayed;
+    _Atomic uint64_t occupancy[STAGE_BINS];
+    stage_source_t sources[STAGE_MAX_SOURCES];
+    _Atomic int64_t last_report;
+} stage_t;
+
+stage_t codec_stage = {.name = "codec"};
+// Into the output threads, or the frame builder with -F or -N
+stage_t output_stage = {.name = "output"};
+
+static __thread unsigned stage_samples;
+
+// Parse "<policy>" for every stage or "<stage>=<policy>,..." Returns -1 if it doesn't make sense.
+int stage_parse(const char *spec) {
+    char *copy = strdup(spec);
+    char *field, *save = NULL;
+    int result = 0;
+    for (field = strtok_r(copy, ",", &save); field != NULL; field = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(field, '=');
+        char *name = eq ? eq + 1 : field;
+        int p;
+        for (p = 0; p < sizeof(overflow_names) / sizeof(overflow_names[0]); p++)
+            if (strcmp(name, overflow_names[p]) == 0)
+                break;
+        if (p == sizeof(overflow_names) / sizeof(overflow_names[0])) {
+            result = -1;
+            break;
+        }
+        if (eq != NULL)
+            *eq = '\0';
+        if (eq == NULL || strcmp(field, codec_stage.name) == 0)
+            codec_stage.policy = p;
+        if (eq == NULL || strcmp(field, output_stage.name) == 0)
+            output_stage.policy = p;
+        if (eq != NULL && strcmp(field, codec_stage.name) != 0 && strcmp(field, output_stage.name) != 0) {
+            result = -1;
+            break;
+        }
+    }
+    free(copy);
+    return result;
+}
+
+// Replays a lane's journal into its queue in the order it was written
+void *replay_thread(void *arg) {
+    stage_lane_t *lane = (stage_lane_t *) arg;
+    // Only this thread takes from the pool
+    stream_pool_t *pool = pool_depth > 0 ? stream_pool_create(pool_depth) : NULL;
+    stream_buffer_t *copy = NULL;
     while (keep_going) {
-        stream_buffer_t *buf = stream_queue_get(out_queue);
-        if (buf == NULL)
+        if (copy == NULL) {
+            if (atomic_load_explicit(&lane->pending, memory_order_acquire) == 0) {
+                usleep(1000);
+                continue;
+            }
+            pthread_mutex_lock(&lane->lock);
+            stream_buffer_t *rec = stream_journal_peek(lane->journal);
+            pthread_mutex_unlock(&lane->lock);
+            // Only this thread moves the read side on, so rec stays put without the lock
+            copy = stream_pool_get(pool, rec->total_length);
+            if (copy == NULL) {
+                // Out of memory, the record is safe in the journal so try again later
+                usleep(1000);
+                continue;
+            }
+            memcpy(copy, rec, rec->total_length);
+        }
+        if (!stream_queue_try_add(lane->queue, copy)) {
+            usleep(100);
+            continue;
+        }
+        copy = NULL;
+        pthread_mutex_lock(&lane->lock);
+        stream_journal_next(lane->journal);
+        pthread_mutex_unlock(&lane->lock);
+        atomic_fetch_sub_explicit(&lane->pending, 1, memory_order_release);
+        atomic_fetch_add_explicit(&lane->stage->replayed, 1, memory_order_relaxed);
+    }
+    // Still in the journal, stage_close counts it with the rest
+    if (copy != NULL)
+        stream_pool_put(copy);
+    return (NULL);
+}
+
+// Queues a stage hands records to must be set up for its policy. Queues are numbered in
+// the order they are made, stage_add takes the number.
+stream_rb_t *stage_queue_create(stage_t *s, int depth) {
+    stage_lane_t *lane = calloc(1, sizeof(stage_lane_t));
+    lane->stage = s;
+    lane->index = s->lane_count;
+    lane->queue = stream_queue_create(depth, STREAM_QUEUE_MPSC, wait_strategy);
+    if (s->policy == OVERFLOW_DROP_OLDEST)
+        stream_queue_allow_evict(lane->queue);
+    if (s->policy == OVERFLOW_SPILL) {
+        char path[1024];
+        // Several segments per journal so disk space is given back as the replay goes
+        size_t segment = journal_queue_cap / 4 < JOURNAL_SEGMENT ? journal_queue_cap / 4 : JOURNAL_SEGMENT;
+        snprintf(path, sizeof(path), "%s-%s-%d", journal_path, s->name, lane->index);
+        lane->journal = stream_journal_open(path, segment, journal_queue_cap);
+        pthread_mutex_init(&lane->lock, NULL);
+        pthread_create(&lane->replay, NULL, replay_thread, (void *) lane);
+    }
+    s->lanes = realloc(s->lanes, (s->lane_count + 1) * sizeof(stage_lane_t *));
+    s->lanes[s->lane_count++] = lane;
+    return lane->queue;
+}
+
+void stage_drop(stage_t *s, stream_buffer_t *buf) {
+    uint64_t key = buf->source_id | (1ULL << 32);
+    uint32_t i, slot = (buf->source_id * 2654435761U) % STAGE_MAX_SOURCES;
+    atomic_fetch_add_explicit(&s->dropped, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->dropped_bytes, buf->total_length, memory_order_relaxed);
+    // Open addressing, once the table is full drops are only counted in the totals
+    for (i = 0; i < STAGE_MAX_SOURCES; i++, slot = (slot + 1) % STAGE_MAX_SOURCES) {
+        stage_source_t *src = &s->sources[slot];
+        uint64_t expected = 0;
+        if (atomic_load_explicit(&src->key, memory_order_acquire) == key ||
+            atomic_compare_exchange_strong(&src->key, &expected, key) || expected == key) {
+            atomic_fetch_add_explicit(&src->records, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&src->bytes, buf->total_length, memory_order_relaxed);
             break;
-        if (zmq_mode) {
-            int n = zmq_send(publish_socket, buf, buf->total_length, 0);
-            if (n == -1) {
-                perror("zmq_send error");
-                break;
+        }
+    }
+    stream_pool_put(buf);
+}
+
+void stage_report(stage_t *s) {
+    int i, last = 0;
+    uint64_t bins[STAGE_BINS];
+    printf("Stage %s (%s) - %lu records, %.6f GByte dropped since start, queue occupancy",
+           s->name, overflow_names[s->policy], (unsigned long) atomic_load(&s->dropped),
+           atomic_load(&s->dropped_bytes) / 1000000000.0);
+    for (i = 0; i < STAGE_BINS; i++)
+        if ((bins[i] = atomic_exchange(&s->occupancy[i], 0)) != 0)
+            last = i;
+    for (i = 0; i <= last; i++) {
+        if (i < 2)
+            printf(" %d:%lu", i, (unsigned long) bins[i]);
+        else
+            printf(" %d-%d:%lu", 1 << (i - 1), (1 << i) - 1, (unsigned long) bins[i]);
+    }
+    printf("\n");
+    if (s->policy == OVERFLOW_SPILL) {
+        uint64_t records = 0, bytes = 0;
+        for (i = 0; i < s->lane_count; i++) {
+            pthread_mutex_lock(&s->lanes[i]->lock);
+            if (s->lanes[i]->journal != NULL) {
+                records += s->lanes[i]->journal->records;
+                bytes += s->lanes[i]->journal->bytes;
+            }
+            pthread_mutex_unlock(&s->lanes[i]->lock);
+        }
+        printf("\t%lu records spilled, %lu replayed since start, %lu records, %.6f GByte in the journal\n",
+               (unsigned long) atomic_load(&s->spilled), (unsigned long) atomic_load(&s->replayed),
+               (unsigned long) records, bytes / 1000000000.0);
+    }
+    for (i = 0; i < STAGE_MAX_SOURCES; i++) {
+        stage_source_t *src = &s->sources[i];
+        if (atomic_load(&src->key) != 0)
+            printf("\tID %08X - %lu records, %.6f GByte dropped\n", (uint32_t) atomic_load(&src->key),
+                   (unsigned long) atomic_load(&src->records), atomic_load(&src->bytes) / 1000000000.0);
+    }
+}
+
+// Note how full q is and, with -s, report every 10 seconds from whichever thread gets there first
+void stage_sample(stage_t *s, stream_rb_t *q) {
+    int n = stream_queue_count(q), bin = 0;
+    while (n > 0 && bin < STAGE_BINS - 1) {
+        n >>= 1;
+        bin++;
+    }
+    atomic_fetch_add_explicit(&s->occupancy[bin], 1, memory_order_relaxed);
+    if (!do_stats)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    int64_t last = atomic_load_explicit(&s->last_report, memory_order_relaxed);
+    if (last == 0)
+        atomic_compare_exchange_strong(&s->last_report, &last, now.tv_sec);
+    else if (now.tv_sec - last >= 10 && atomic_compare_exchange_strong(&s->last_report, &last, now.tv_sec))
+        stage_report(s);
+}
+
+// Spill buf to the lane's journal, or drop it if the journal is full or closed
+void stage_spill(stage_t *s, stage_lane_t *lane, stream_buffer_t *buf) {
+    pthread_mutex_lock(&lane->lock);
+    int spilled = lane->journal != NULL && stream_journal_append(lane->journal, buf) == 0;
+    if (spilled)
+        atomic_fetch_add_explicit(&lane->pending, 1, memory_order_release);
+    pthread_mutex_unlock(&lane->lock);
+    if (!spilled) {
+        stage_drop(s, buf);
+        return;
+    }
+    atomic_fetch_add_explicit(&s->spilled, 1, memory_order_relaxed);
+    stream_pool_put(buf);
+}
+
+// At shutdown stop the replay threads and delete the journals, reporting the records
+// that were spilled but never made it back into a queue.
+void stage_close(stage_t *s) {
+    uint64_t records = 0, bytes = 0;
+    int i;
+    if (s->policy != OVERFLOW_SPILL)
+        return;
+    for (i = 0; i < s->lane_count; i++) {
+        stage_lane_t *lane = s->lanes[i];
+        pthread_join(lane->replay, NULL);
+        pthread_mutex_lock(&lane->lock);
+        records += lane->journal->records;
+        bytes += lane->journal->bytes;
+        stream_journal_close(lane->journal);
+        lane->journal = NULL;
+        pthread_mutex_unlock(&lane->lock);
+    }
+    atomic_fetch_add(&s->dropped, records);
+    atomic_fetch_add(&s->dropped_bytes, bytes);
+    printf("Stage %s (spill) - %lu records spilled, %lu replayed, %lu records, %.6f GByte never replayed\n",
+           s->name, (unsigned long) atomic_load(&s->spilled), (unsigned long) atomic_load(&s->replayed),
+           (unsigned long) records, bytes / 1000000000.0);
+}
+
+// Hand buf to queue number index following the stage's policy, buf is no longer ours either way.
+void stage_add(stage_t *s, int index, stream_buffer_t *buf) {
+    stage_lane_t *lane = s->lanes[index];
+    stream_rb_t *q = lane->queue;
+    if (stage_samples++ % STAGE_SAMPLE == 0)
+        stage_sample(s, q);
+    switch (s->policy) {
+        case OVERFLOW_DROP_NEWEST:
+            if (!stream_queue_try_add(q, buf))
+                stage_drop(s, buf);
+            break;
+        case OVERFLOW_DROP_OLDEST:
+            while (!stream_queue_try_add(q, buf)) {
+                stream_buffer_t *old = stream_queue_evict(q);
+                if (old != NULL)
+                    stage_drop(s, old);
+            }
+            break;
+        case OVERFLOW_SPILL:
+            // Nothing waiting in the journal means nothing from this source can be either
+            if (atomic_load_explicit(&lane->pending, memory_order_acquire) != 0 || !stream_queue_try_add(q, buf))
+                stage_spill(s, lane, buf);
+            break;
+        default:
+            stream_queue_add(q, buf);
+    }
+}
+
+// Monitoring tap, set by -T. A sample of the records is copied to a second publish socket
+// by a thread of its own. Copies that don't fit in its queue are dropped so the tap
+// can never slow down the main output.
+char *tap_url = NULL;
+// Copy one in every tap_every records
+int tap_every = 100;
+// Most records per second the tap publishes, 0 = no limit
+int tap_rate = 0;
+// Most payload bytes copied per record, -1 = all of it, 0 = header only
+int tap_payload = -1;
+stream_rb_t *tap_queue;
+// Statistics
+_Atomic uint64_t tap_sampled;
+_Atomic uint64_t tap_queue_drops;
+uint64_t tap_rate_drops;
+uint64_t tap_sent;
+
+// Copy buf to the tap if it is its turn, counter belongs to the calling thread.
+void tap_offer(stream_buffer_t *buf, uint64_t *counter) {
+    if (tap_url == NULL || (*counter)++ % tap_every != 0)
+        return;
+    size_t payload = buf->total_length - sizeof(stream_buffer_t);
+    if (tap_payload >= 0 && payload > tap_payload)
+        payload = tap_payload;
+    size_t length = sizeof(stream_buffer_t) + ((payload + 3) & ~3);
+    stream_buffer_t *copy = stream_pool_get(NULL, length);
+    if (copy == NULL)
+        return;
+    memcpy(copy, buf, length);
+    // The lengths only cover what was copied, so a consumer never reads past the message
+    if (length < buf->total_length) {
+        copy->total_length = length;
+        if (copy->payload_length > payload)
+            copy->payload_length = payload;
+        if (copy->compressed_length > payload)
+            copy->compressed_length = payload;
+        copy->flags |= STREAM_FLAG_TRUNCATED;
+    }
+    atomic_fetch_add_explicit(&tap_sampled, 1, memory_order_relaxed);
+    if (!stream_queue_try_add(tap_queue, copy)) {
+        atomic_fetch_add_explicit(&tap_queue_drops, 1, memory_order_relaxed);
+        stream_pool_put(copy);
+    }
+}
+
+void *tap_thread(void *arg) {
+    void *tap_socket = arg;
+    struct timespec now, second, stats;
+    int this_second = 0;
+    printf("Tap thread starts -------\n");
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &second);
+    stats = second;
+    while (keep_going) {
+        stream_buffer_t *buf = stream_queue_get(tap_queue);
+        if (buf == NULL)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        if (now.tv_sec != second.tv_sec) {
+            second = now;
+            this_second = 0;
+        }
+        if (tap_rate > 0 && this_second >= tap_rate) {
+            tap_rate_drops++;
+            stream_pool_put(buf);
+        }
+        else if (zmq_mode) {
+            zmq_msg_t msg;
+            zmq_msg_init_data(&msg, buf, buf->total_length, buf_free, NULL);
+            // PUB drops rather than blocks when a subscriber falls behind
+            if (zmq_msg_send(&msg, tap_socket, ZMQ_DONTWAIT) == -1)
+                zmq_msg_close(&msg);
+            else {
+                this_second++;
+                tap_sent++;
             }
         }
-        // Done with this buffer
-        free(buf);
+        else {
+            this_second++;
+            tap_sent++;
+            stream_pool_put(buf);
+        }
+        if (do_stats && now.tv_sec - stats.tv_sec >= 10) {
+            printf("Tap - %lu sampled, %lu sent, %lu dropped on a full queue, %lu dropped over the rate limit\n",
+                   (unsigned long) atomic_load(&tap_sampled), (unsigned long) tap_sent,
+                   (unsigned long) atomic_load(&tap_queue_drops), (unsigned long) tap_rate_drops);
+            stats = now;
+        }
     }
-    printf("Output thread ends -------\n");
+    printf("Tap thread ends -------\n");
     return (NULL);
 }
 
-void *worker_routine(void *arg) {
-    worker_thread_context_t *ctx = arg;
-    ctx->thread = pthread_self();
-    int looping = 1;
-    uint32_t magic, source_id;
-    uint64_t data_counter, loop_counter;
-    struct timespec tStart, tEnd, tDiff;
-    // First thing on the socket is the magic number
-    read(ctx->socket, &magic, 4);
-    if (magic != CODA_MAGIC) {
-        printf("*** Spurious connect attempt *** : magic read %08x\n", magic);
+void start_tap(void *context) {
+    void *tap_socket = NULL;
+    pthread_t thread;
+    tap_queue = stream_queue_create(out_queue_depth, STREAM_QUEUE_MPSC, wait_strategy);
+    if (zmq_mode) {
+        // A short send queue, monitoring subscribers that can't keep up just lose records
+        int hwm = 100;
+        tap_socket = zmq_socket(context, ZMQ_PUB);
+        zmq_setsockopt(tap_socket, ZMQ_SNDHWM, &hwm, sizeof(hwm));
+        if (zmq_bind(tap_socket, tap_url) == -1) {
+            printf("Can't publish the tap on %s -> ", tap_url);
+            perror("zmq_bind error :");
+            exit(-1);
+        }
     }
-    else {
-        // Second thing on the thread is the source ID
-        int nr = read(ctx->socket, &source_id, 4);
-        if (nr != 4) {
-            printf("expected ID but only read %d bytes\n", nr);
-            return (NULL);
-        }
-        sprintf(ctx->name, "%08X", source_id);
-        printf("Worker thread %s starts -------\n", ctx->name);
-        // If we ever exit the loop and buf != NULL then we must free it.
-        stream_buffer_t *buf = NULL;
-        data_counter = 0;
-        loop_counter = 0;
-        clock_gettime(CLOCK_REALTIME, &tStart);
-        while (looping && keep_going) {
-            // stream_buffer_t *buf = (stream_buffer_t *) stream_queue_get(ctx->queue);
-            // Read the ID from the block header.
-            int nread;
-            uint32_t block_length;
-            uint8_t *lptr;
-            // Read the ID
-            nread = 0;
-            lptr = (uint8_t *) &source_id;
-            if (do_debug > 0)
-                printf("Read the ID - 4 bytes \n");
-            while (nread < 4) {
-                int n = read(ctx->socket, lptr + nread, 4 - nread);
-                if (n <= 0) {
-                    looping = 0;
+    pthread_create(&thread, NULL, tap_thread, tap_socket);
+}
+
+// Server side filters, set by -x. Publish sockets are XPUB and subscriptions starting with
+// STREAM_FILTER_PREFIX are parsed into filters that are applied before publishing.
+int do_filters = 0;
+
+#define FILTER_MAX_SOURCES 16
+
+typedef struct stream_filter {
+    // The subscription topic, each matching record is sent prefixed with it
+    char *topic;
+    size_t topic_length;
+    // Sources to pass, all if source_count is 0
+    uint32_t sources[FILTER_MAX_SOURCES];
+    int source_count;
+    // Pass one in every records that match the rest of the filter
+    uint32_t every;
+    uint64_t matched;
+    // Pass records with (flags & flag_mask) == flag_value
+    uint32_t flag_mask;
+    uint32_t flag_value;
+    // Pass records with a timestamp in [after, before) nanoseconds, 0 = open
+    uint64_t after;
+    uint64_t before;
+    uint64_t sent;
+} stream_filter_t;
+
+typedef struct output_thread_context {
+    int index;
+    stream_rb_t *queue;
+    void *publish_socket;
+    pthread_t thread;
+    stream_filter_t *filters;
+    int filter_count;
+    uint64_t records;
+    uint64_t tap_counter;
+    stream_latency_t *latency;
+    _Atomic uint64_t published;
+    _Atomic uint64_t published_bytes;
+} output_thread_context_t;
+
+output_thread_context_t *output_threads;
+
+// Queued to an output thread at exit so it stops once it has published what is ahead of it
+static stream_buffer_t output_stop;
+
+// Records from one source always go to the same output thread so they leave in order.
+void output_add(stream_buffer_t *buf) {
+    if (frame_key != FRAME_OFF) {
+        stage_add(&output_stage, 0, buf);
+        return;
+    }
+    stage_add(&output_stage, buf->source_id % output_thread_count, buf);
+}
+
+// URL shard k publishes on. tcp://host:port URLs count up from the port, anything
+// else gets -k appended.
+char *shard_url(int k) {
+    char *url = malloc(strlen(publisher) + 16);
+    char *colon = strrchr(publisher, ':');
+    if (k == 0)
+        strcpy(url, publisher);
+    else if (colon != NULL && colon[1] != '\0' && strspn(colon + 1, "0123456789") == strlen(colon + 1))
+        sprintf(url, "%.*s:%d", (int) (colon - publisher), publisher, atoi(colon + 1) + k);
+    else
+        sprintf(url, "%s-%d", publisher, k);
+    return url;
+}
+
+// Parse a filter topic, e.g. "filter:src=0xC0DA0001,0xC0DA0002;every=100;flags=0x1/0x1".
+// Returns -1 if it doesn't make sense.
+int filter_parse(stream_filter_t *f, const char *topic) {
+    char *spec = strdup(topic + strlen(STREAM_FILTER_PREFIX));
+    char *field, *save = NULL;
+    int result = 0;
+    bzero(f, sizeof(stream_filter_t));
+    f->every = 1;
+    for (field = strtok_r(spec, ";", &save); field != NULL; field = strtok_r(NULL, ";", &save)) {
+        char *value = strchr(field, '=');
+        if (value == NULL) {
+            result = -1;
+            break;
+        }
+        *value++ = '\0';
+        if (strcmp(field, "src") == 0) {
+            char *id, *save_id = NULL;
+            for (id = strtok_r(value, ",", &save_id); id != NULL; id = strtok_r(NULL, ",", &save_id)) {
+                if (f->source_count == FILTER_MAX_SOURCES) {
+                    result = -1;
                     break;
                 }
-                nread += n;
+                f->sources[f->source_count++] = strtoul(id, NULL, 0);
             }
-            if (!looping || !keep_going)
-                break;
-            if (do_debug > 0)
-                printf(" \tID = %08X\n", source_id);
-            // Read the length
-            nread = 0;
-            lptr = (uint8_t *) &block_length;
-            if (do_debug > 0)
-                printf("read overall length\n");
-            while (nread < 4) {
-                int n = read(ctx->socket, lptr + nread, 4 - nread);
-                if (n <= 0) {
-                    looping = 0;
+        }
+        else if (strcmp(field, "every") == 0) {
+            f->every = strtoul(value, NULL, 0);
+            if (f->every < 1)
+                result = -1;
+        }
+        else if (strcmp(field, "flags") == 0) {
+            char *slash = strchr(value, '/');
+            f->flag_mask = strtoul(value, NULL, 0);
+            f->flag_value = slash != NULL ? strtoul(slash + 1, NULL, 0) : f->flag_mask;
+        }
+        else if (strcmp(field, "after") == 0)
+            f->after = strtod(value, NULL) * 1000000000.0;
+        else if (strcmp(field, "before") == 0)
+            f->before = strtod(value, NULL) * 1000000000.0;
+        else
+            result = -1;
+    }
+    free(spec);
+    return result;
+}
+
+int filter_match(stream_filter_t *f, stream_buffer_t *buf) {
+    int i;
+    if (f->source_count > 0) {
+        for (i = 0; i < f->source_count && f->sources[i] != buf->source_id; i++);
+        if (i == f->source_count)
+            return FALSE;
+    }
+    if ((buf->flags & f->flag_mask) != f->flag_value)
+        return FALSE;
+    if (f->after != 0 || f->before != 0) {
+        uint64_t t = (uint64_t) buf->timestamp.tv_sec * 1000000000 + buf->timestamp.tv_nsec;
+        if (t < f->after || (f->before != 0 && t >= f->before))
+            return FALSE;
+    }
+    return f->matched++ % f->every == 0;
+}
+
+// Read subscribe and unsubscribe messages from the XPUB socket. ZMQ only passes on the
+// first subscription and the last unsubscription of a topic, so each distinct filter
+// has one entry however many subscribers share it.
+void read_subscriptions(output_thread_context_t *out) {
+    char data[256];
+    int n, i;
+    size_t prefix = strlen(STREAM_FILTER_PREFIX);
+    while ((n = zmq_recv(out->publish_socket, data, sizeof(data) - 1, ZMQ_DONTWAIT)) >= 0) {
+        // Plain source ID subscriptions are left to ZMQ
+        if (n >= sizeof(data) || n < 1 + prefix || memcmp(data + 1, STREAM_FILTER_PREFIX, prefix) != 0)
+            continue;
+        data[n] = '\0';
+        if (data[0] == 0) {
+            for (i = 0; i < out->filter_count; i++) {
+                if (strcmp(out->filters[i].topic, data + 1) == 0) {
+                    printf("Output thread %d drops filter %s after %lu records\n", out->index,
+                           data + 1, (unsigned long) out->filters[i].sent);
+                    free(out->filters[i].topic);
+                    out->filters[i] = out->filters[--out->filter_count];
                     break;
                 }
-                nread += n;
             }
-            if (!looping || !keep_going)
-                break;
-            if (do_debug > 0)
-                printf("\tlength = %d\n", block_length);
-            // Here we take ownership of memory so we have to free it somewhere.
-            buf = (stream_buffer_t *) malloc(block_length);
-            buf->total_length = block_length;
-            buf->source_id = source_id;
-            nread = 8;
-            uint8_t *bptr = (uint8_t *) buf;
-            while (nread < block_length) {
-                int n = read(ctx->socket, bptr + nread, block_length - nread);
-                if (n <= 0) {
-                    looping = 0;
-                    // Here we free the buffer id something goes wrong
+            continue;
+        }
+        stream_filter_t f;
+        if (filter_parse(&f, data + 1) < 0) {
+            printf("Output thread %d ignores bad filter %s\n", out->index, data + 1);
+            continue;
+        }
+        f.topic = strdup(data + 1);
+        f.topic_length = n - 1;
+        out->filters = realloc(out->filters, (out->filter_count + 1) * sizeof(stream_filter_t));
+        assert(out->filters != NULL);
+        out->filters[out->filter_count++] = f;
+        printf("Output thread %d adds filter %s\n", out->index, f.topic);
+    }
+}
+
+// Send msg, the message for buf, to every filter it matches. The copies share the buffer.
+// The topic and the record are one message, a signal is retried rather than leaving it
+// half sent. Returns -1 if the record couldn't follow its topic, the socket is then in
+// the middle of a message and can't be used again.
+int filter_publish(output_thread_context_t *out, stream_buffer_t *buf, zmq_msg_t *msg) {
+    int i, rc;
+    for (i = 0; i < out->filter_count; i++) {
+        stream_filter_t *f = &out->filters[i];
+        if (!filter_match(f, buf))
+            continue;
+        while ((rc = zmq_send(out->publish_socket, f->topic, f->topic_length, ZMQ_SNDMORE)) == -1 && errno == EINTR)
+            ;
+        if (rc == -1) {
+            perror("zmq_send error");
+            continue;
+        }
+        zmq_msg_t copy;
+        zmq_msg_init(&copy);
+        zmq_msg_copy(&copy, msg);
+        while ((rc = zmq_msg_send(&copy, out->publish_socket, 0)) == -1 && errno == EINTR)
+            ;
+        if (rc == -1) {
+            perror("zmq_msg_send error");
+            zmq_msg_close(&copy);
+            return -1;
+        }
+        f->sent++;
+    }
+    return 0;
+}
+
+void *output_thread(void *arg) {
+    output_thread_context_t *out = (output_thread_context_t *) arg;
+    void *publish_socket = out->publish_socket;
+    printf("Output thread %d starts -------\n", out->index);
+    while (keep_going) {
+        stream_buffer_t *buf = stream_queue_get(out->queue);
+        if (buf == NULL || buf == &output_stop)
+            break;
+        tap_offer(buf, &out->tap_counter);
+        if (out->latency != NULL) {
+            struct timespec now;
+            stream_clock_now(buf->flags, &now);
+            stream_latency_record(out->latency, buf, &now);
+            stream_latency_tick(out->latency);
+        }
+        counter_add(&out->published, 1);
+        counter_add(&out->published_bytes, buf->total_length);
+        if (zmq_mode) {
+            // Hand the buffer to ZMQ rather than copying it, buf_free releases it
+            // once the message has gone out.
+            zmq_msg_t msg;
+            zmq_msg_init_data(&msg, buf, buf->total_length, buf_free, NULL);
+            if (do_filters) {
+                // Looking for new subscriptions now and then is plenty
+                if (out->records++ % 64 == 0)
+                    read_subscriptions(out);
+                if (filter_publish(out, buf, &msg) < 0) {
+                    zmq_msg_close(&msg);
                     break;
                 }
-                nread += n;
             }
-            if (!looping || !keep_going)
+            int n = zmq_msg_send(&msg, publish_socket, 0);
+            if (n == -1) {
+                perror("zmq_msg_send error");
+                // On failure ownership stays with the message, closing it frees buf.
+                zmq_msg_close(&msg);
                 break;
-            // Handle statistics...
-            data_counter += nread;
-            loop_counter++;
-            clock_gettime(CLOCK_REALTIME, &tEnd);
-            time_subtract(&tDiff, &tEnd, &tStart);
-            double tDiffDouble = ((float) tDiff.tv_sec) + ((float) tDiff.tv_nsec / 1000000000.0);
-            if (do_stats && (tDiffDouble > 10.0)) {
-                double loop_rate, data_rate;
-                loop_rate = ((float) loop_counter) / tDiffDouble;
-                data_rate = ((float) data_counter) / (tDiffDouble * 1000000000.0); // GByte/s
-                printf("ID %08X - buffer rate %.2f Hz, data rate %.6f GByte/s \n",
-                        buf->source_id, loop_rate, data_rate);
-                data_counter = 0;
-                loop_counter = 0;
-                clock_gettime(CLOCK_REALTIME, &tStart);
             }
-            if (do_debug > 0)
-                printf("read %d bytes of data\n", nread);
-            if (buf->magic != CODA_MAGIC)
-                printf("Magic number error %08x should be %08x\n", buf->magic, CODA_MAGIC);
-            if (do_debug > 1)
-                print_data_hex((uint8_t *) buf, buf->total_length);
-            if (do_debug > 0)
-                printf("read ID from block header %08X\n", buf->source_id);
-            if (buf->source_id != source_id) {
-                printf("*** ID from block header %08X != ID from connect %08X\n", buf->source_id, source_id);
-                break;
+        }
+        else
+            // Done with this buffer
+            stream_pool_put(buf);
+    }
+    printf("Output thread %d ends -------\n", out->index);
+    return (NULL);
+}
+
+void start_output_threads(void *context) {
+    int i;
+    output_threads = calloc(output_thread_count, sizeof(output_thread_context_t));
+    for (i = 0; i < output_thread_count; i++) {
+        output_thread_context_t *out = &output_threads[i];
+        out->index = i;
+        out->queue = stage_queue_create(&output_stage, out_queue_depth);
+        if (do_latency)
+            out->latency = stream_latency_create("publish", LATENCY_INTERVAL);
+        if (zmq_mode) {
+            // Create a ZMQ publish socket, it is only ever used by this output thread
+            char *url = shard_url(i);
+            out->publish_socket = zmq_socket(context, do_filters ? ZMQ_XPUB : ZMQ_PUB);
+            if (zmq_bind(out->publish_socket, url) == -1) {
+                printf("Can't publish on %s -> ", url);
+                perror("zmq_bind error :");
+                exit(-1);
             }
-            if (do_debug > 0)
-                printf("Add buffer to output stream\n");
-            // we give up ownership of the buffer
-            stream_queue_add(out_queue, buf);
-            buf = NULL;
+            printf("\t Output thread %d publishes on %s\n", i, url);
+            free(url);
+        }
+        pthread_create(&out->thread, NULL, output_thread, (void *) out);
+    }
+}
+
+#define FRAME_MAX_SOURCES 256
+#define FRAME_MAX_OPEN 64
+// A source that sends nothing for this many timeouts is no longer waited for
+#define FRAME_SOURCE_EXPIRY 10
+
+typedef struct frame_source {
+    uint32_t source_id;
+    int active;
+    // Newest frame this source has sent a record for. Records from a source arrive in
+    // order so once this passes a frame the source has nothing more for it.
+    uint64_t last_frame;
+    struct timespec last_seen;
+} frame_source_t;
+
+typedef struct frame {
+    uint64_t number;
+    struct timespec opened;
+    stream_buffer_t **records;
+    int count;
+    int capacity;
+    // Bit per entry in the builder's source table
+    uint8_t present[FRAME_MAX_SOURCES / 8];
+    int sources;
+} frame_t;
+
+typedef struct frame_builder {
+    void *publish_socket;
+    frame_source_t sources[FRAME_MAX_SOURCES];
+    int source_count;
+    // Open frames, oldest first
+    frame_t open[FRAME_MAX_OPEN];
+    int open_count;
+    int published_any;
+    uint64_t last_published;
+    // Statistics
+    uint64_t frames;
+    uint64_t records;
+    uint64_t partial;
+    uint64_t dropped;
+    uint64_t late;
+    struct timespec tStart;
+    uint64_t tap_counter;
+    stream_latency_t *latency;
+    _Atomic uint64_t published;
+    _Atomic uint64_t published_bytes;
+    pthread_t thread;
+} frame_builder_t;
+
+frame_builder_t *frame_builder;
+
+static inline uint64_t frame_number(stream_buffer_t *buf) {
+    if (frame_key == FRAME_BY_COUNTER)
+        return buf->record_counter / frame_window;
+    return ((uint64_t) buf->timestamp.tv_sec * 1000000000 + buf->timestamp.tv_nsec) / frame_window;
+}
+
+static inline long elapsed_ms(struct timespec *now, struct timespec *then) {
+    return (now->tv_sec - then->tv_sec) * 1000 + (now->tv_nsec - then->tv_nsec) / 1000000;
+}
+
+// Index of a source in the table, adding it if it is new. -1 if the table is full.
+int frame_source(frame_builder_t *b, uint32_t source_id) {
+    int i;
+    for (i = 0; i < b->source_count; i++)
+        if (b->sources[i].source_id == source_id)
+            return i;
+    if (b->source_count == FRAME_MAX_SOURCES)
+        return -1;
+    b->sources[i].source_id = source_id;
+    b->sources[i].active = 0;
+    printf("Frame builder adds source %08X\n", source_id);
+    return b->source_count++;
+}
+
+// Active sources that have nothing in frame f
+int frame_missing(frame_builder_t *b, frame_t *f) {
+    int i, missing = 0;
+    for (i = 0; i < b->source_count; i++)
+        if (b->sources[i].active && !(f->present[i / 8] & (1 << (i % 8))))
+            missing++;
+    return missing;
+}
+
+// A frame is complete when every active source has moved on past it
+int frame_complete(frame_builder_t *b, frame_t *f) {
+    int i;
+    for (i = 0; i < b->source_count; i++)
+        if (b->sources[i].active && b->sources[i].last_frame <= f->number)
+            return FALSE;
+    return TRUE;
+}
+
+void frame_publish(frame_builder_t *b, frame_t *f) {
+    int i, missing = frame_missing(b, f);
+    int send = zmq_mode && !(missing > 0 && frame_drop_incomplete);
+    if (missing > 0 && frame_drop_incomplete)
+        b->dropped++;
+    else {
+        b->frames++;
+        if (missing > 0)
+            b->partial++;
+    }
+    if (send) {
+        stream_frame_t header;
+        bzero(&header, sizeof(header));
+        header.frame_id = STREAM_FRAME_ID;
+        header.magic = CODA_MAGIC;
+        header.records = f->count;
+        header.sources = f->sources;
+        header.missing = missing;
+        header.flags = frame_key == FRAME_BY_COUNTER ? STREAM_FRAME_BY_COUNTER : 0;
+        header.frame_number = f->number;
+        header.window = frame_window;
+        if (zmq_send(b->publish_socket, &header, sizeof(header), ZMQ_SNDMORE) == -1) {
+            perror("zmq_send error");
+            send = FALSE;
+        }
+    }
+    for (i = 0; i < f->count; i++) {
+        if (!send) {
+            stream_pool_put(f->records[i]);
+            continue;
+        }
+        if (b->latency != NULL) {
+            struct timespec now;
+            stream_clock_now(f->records[i]->flags, &now);
+            stream_latency_record(b->latency, f->records[i], &now);
+        }
+        counter_add(&b->published, 1);
+        counter_add(&b->published_bytes, f->records[i]->total_length);
+        // Every record is a part of its own, handed over without a copy like output_thread
+        zmq_msg_t msg;
+        zmq_msg_init_data(&msg, f->records[i], f->records[i]->total_length, buf_free, NULL);
+        if (zmq_msg_send(&msg, b->publish_socket, i < f->count - 1 ? ZMQ_SNDMORE : 0) == -1) {
+            perror("zmq_msg_send error");
+            zmq_msg_close(&msg);
+            send = FALSE;
+        }
+    }
+    b->published_any = TRUE;
+    b->last_published = f->number;
+    free(f->records);
+}
+
+// Find the open frame with this number, opening it if there isn't one.
+frame_t *frame_open(frame_builder_t *b, uint64_t number, struct timespec *now) {
+    int i;
+    for (i = b->open_count; i > 0 && b->open[i - 1].number >= number; i--)
+        if (b->open[i - 1].number == number)
+            return &b->open[i - 1];
+    // Out of room, the oldest frame has to go whether it is complete or not
+    if (b->open_count == FRAME_MAX_OPEN) {
+        if (i == 0) {
+            // and this record would have been in an even older frame
+            return NULL;
+        }
+        frame_publish(b, &b->open[0]);
+        memmove(&b->open[0], &b->open[1], (FRAME_MAX_OPEN - 1) * sizeof(frame_t));
+        b->open_count--;
+        i--;
+    }
+    memmove(&b->open[i + 1], &b->open[i], (b->open_count - i) * sizeof(frame_t));
+    b->open_count++;
+    frame_t *f = &b->open[i];
+    bzero(f, sizeof(frame_t));
+    f->number = number;
+    f->opened = *now;
+    return f;
+}
+
+void frame_add(frame_builder_t *b, stream_buffer_t *buf, struct timespec *now) {
+    uint64_t number = frame_number(buf);
+    tap_offer(buf, &b->tap_counter);
+    int s = frame_source(b, buf->source_id);
+    frame_t *f = NULL;
+    // Its frame has already gone, or there is no room for it
+    if (s >= 0 && !(b->published_any && number <= b->last_published))
+        f = frame_open(b, number, now);
+    if (f == NULL) {
+        b->late++;
+        stream_pool_put(buf);
+        return;
+    }
+    frame_source_t *src = &b->sources[s];
+    if (!src->active || number > src->last_frame)
+        src->last_frame = number;
+    src->active = TRUE;
+    src->last_seen = *now;
+    if (f->count == f->capacity) {
+        f->capacity = f->capacity ? 2 * f->capacity : 16;
+        f->records = realloc(f->records, f->capacity * sizeof(stream_buffer_t *));
+        assert(f->records != NULL);
+    }
+    f->records[f->count++] = buf;
+    if (!(f->present[s / 8] & (1 << (s % 8)))) {
+        f->present[s / 8] |= 1 << (s % 8);
+        f->sources++;
+    }
+    b->records++;
+}
+
+// Publish frames from the oldest while they are complete or have timed out.
+void frame_flush(frame_builder_t *b, struct timespec *now) {
+    int i;
+    for (i = 0; i < b->source_count; i++)
+        if (b->sources[i].active &&
+            elapsed_ms(now, &b->sources[i].last_seen) > FRAME_SOURCE_EXPIRY * frame_timeout_ms) {
+            printf("Frame builder stops waiting for source %08X\n", b->sources[i].source_id);
+            b->sources[i].active = FALSE;
+        }
+    while (b->open_count > 0) {
+        frame_t *f = &b->open[0];
+        if (!frame_complete(b, f) && elapsed_ms(now, &f->opened) < frame_timeout_ms)
+            break;
+        frame_publish(b, f);
+        b->open_count--;
+        memmove(&b->open[0], &b->open[1], b->open_count * sizeof(frame_t));
+    }
+}
+
+void *frame_thread(void *arg) {
+    frame_builder_t *b = (frame_builder_t *) arg;
+    stream_buffer_t *bufs[64];
+    struct timespec now;
+    printf("Frame builder starts -------\n");
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &b->tStart);
+    while (keep_going) {
+        // Poll so that frames still time out when nothing arrives
+        int i, count = stream_queue_try_get_batch(frame_queue, (void **) bufs, 64);
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        for (i = 0; i < count; i++)
+            frame_add(b, bufs[i], &now);
+        frame_flush(b, &now);
+        if (b->latency != NULL)
+            stream_latency_tick(b->latency);
+        if (count == 0)
+            usleep(100);
+        if (do_stats && elapsed_ms(&now, &b->tStart) >= 10000) {
+            printf("Frame builder - %lu frames, %lu records, %lu with missing sources, %lu dropped, %lu late records, %d open\n",
+                   (unsigned long) b->frames, (unsigned long) b->records, (unsigned long) b->partial,
+                   (unsigned long) b->dropped, (unsigned long) b->late, b->open_count);
+            b->frames = b->records = b->partial = b->dropped = b->late = 0;
+            b->tStart = now;
         }
-        if (buf != NULL) {
-            printf("Worker thread %s left the main thread and buf != NULL, so free(buf)\n", ctx->name);
-            free(buf);
+    }
+    printf("Frame builder ends -------\n");
+    return (NULL);
+}
+
+void start_frame_builder(void *context) {
+    frame_builder_t *b = calloc(1, sizeof(frame_builder_t));
+    frame_queue = stage_queue_create(&output_stage, out_queue_depth);
+    if (do_latency)
+        b->latency = stream_latency_create("publish", LATENCY_INTERVAL);
+    frame_builder = b;
+    if (zmq_mode) {
+        b->publish_socket = zmq_socket(context, ZMQ_PUB);
+        if (zmq_bind(b->publish_socket, publisher) == -1) {
+            printf("Can't publish on %s -> ", publisher);
+            perror("zmq_bind error :");
+            exit(-1);
         }
     }
+    pthread_create(&b->thread, NULL, frame_thread, (void *) b);
+}
+
+// The codec stage sits between the connections and the output threads. All records from one
+// source go through the same codec thread so their order is kept.
+typedef struct codec_thread_context {
+    int index;
+    stream_rb_t *in_queue;
+    stream_pool_t *pool;
+    // Statistics
+    uint64_t records;
+    uint64_t decompressed;
+    uint64_t compressed;
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    struct timespec tStart;
+} codec_thread_context_t;
+
+codec_thread_context_t *codec_threads;
+
+// Expand a compressed record into a new buffer. Returns NULL if it can't be.
+stream_buffer_t *codec_expand(codec_thread_context_t *t, stream_buffer_t *buf) {
+    stream_codec_t codec = stream_codec_of(buf->flags);
+    if (buf->compressed_length > buf->total_length - sizeof(stream_buffer_t)) {
+        printf("*** ID %08X record %lu compressed length %d doesn't fit in the record\n",
+               buf->source_id, (unsigned long) buf->record_counter, buf->compressed_length);
+        return NULL;
+    }
+    size_t length = sizeof(stream_buffer_t) + ((buf->payload_length + 3) & ~3);
+    stream_buffer_t *raw = stream_pool_get(t->pool, length);
+    if (raw == NULL) {
+        printf("Codec thread %d cannot allocate buffer of %lu bytes\n", t->index, (unsigned long) length);
+        return NULL;
+    }
+    ssize_t n = stream_codec_decompress(codec, buf->payload, buf->compressed_length,
+                                        raw->payload, buf->payload_length);
+    if (n != buf->payload_length) {
+        printf("*** ID %08X record %lu can't be expanded with %s\n", buf->source_id,
+               (unsigned long) buf->record_counter, stream_codec_name(codec));
+        stream_pool_put(raw);
+        return NULL;
+    }
+    memcpy(raw, buf, sizeof(stream_buffer_t));
+    memset((uint8_t *) raw->payload + n, 0, length - sizeof(stream_buffer_t) - n);
+    raw->total_length = length;
+    raw->compressed_length = raw->payload_length;
+    raw->flags &= ~STREAM_FLAG_CODEC_MASK;
+    t->decompressed++;
+    return raw;
+}
+
+// Compress a raw record into a new buffer. Returns NULL if it doesn't get smaller.
+stream_buffer_t *codec_shrink(codec_thread_context_t *t, stream_buffer_t *buf) {
+    if (buf->payload_length > buf->total_length - sizeof(stream_buffer_t))
+        return NULL;
+    size_t capacity = (stream_codec_bound(publish_codec, buf->payload_length) + 3) & ~3;
+    stream_buffer_t *out = stream_pool_get(t->pool, sizeof(stream_buffer_t) + capacity);
+    if (out == NULL) {
+        printf("Codec thread %d cannot allocate buffer of %lu bytes\n", t->index,
+               (unsigned long) (sizeof(stream_buffer_t) + capacity));
+        return NULL;
+    }
+    size_t n = stream_codec_compress(publish_codec, publish_level, buf->payload, buf->payload_length,
+                                     out->payload, capacity);
+    if (n == 0 || n >= buf->payload_length) {
+        stream_pool_put(out);
+        return NULL;
+    }
+    memcpy(out, buf, sizeof(stream_buffer_t));
+    memset((uint8_t *) out->payload + n, 0, ((n + 3) & ~3) - n);
+    out->total_length = sizeof(stream_buffer_t) + ((n + 3) & ~3);
+    out->compressed_length = n;
+    out->flags = (buf->flags & ~STREAM_FLAG_CODEC_MASK) | (publish_codec << STREAM_FLAG_CODEC_SHIFT);
+    t->compressed++;
+    return out;
+}
+
+// Bring a record to publish_codec. Records that are already there, or that can't be
+// expanded, go out as they came in.
+stream_buffer_t *codec_record(codec_thread_context_t *t, stream_buffer_t *buf) {
+    stream_codec_t codec = stream_codec_of(buf->flags);
+    if (codec == publish_codec)
+        return buf;
+    if (codec != STREAM_CODEC_NONE) {
+        stream_buffer_t *raw = codec_expand(t, buf);
+        if (raw == NULL) {
+            t->errors++;
+            return buf;
+        }
+        stream_pool_put(buf);
+        buf = raw;
+    }
+    if (publish_codec != STREAM_CODEC_NONE) {
+        stream_buffer_t *out = codec_shrink(t, buf);
+        if (out != NULL) {
+            stream_pool_put(buf);
+            buf = out;
+        }
+    }
+    return buf;
+}
+
+void *codec_thread(void *arg) {
+    codec_thread_context_t *t = (codec_thread_context_t *) arg;
+    struct timespec tEnd, tDiff;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t->tStart);
+    while (keep_going) {
+        stream_buffer_t *buf = stream_queue_get(t->in_queue);
+        if (buf == NULL)
+            continue;
+        t->records++;
+        t->bytes_in += buf->total_length;
+        buf = codec_record(t, buf);
+        t->bytes_out += buf->total_length;
+        output_add(buf);
+        if (!do_stats)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &tEnd);
+        time_subtract(&tDiff, &tEnd, &t->tStart);
+        if (tDiff.tv_sec >= 10) {
+            printf("Codec thread %d - %lu records, %lu expanded, %lu compressed, %lu errors, %.6f GByte in, %.6f GByte out\n",
+                   t->index, (unsigned long) t->records, (unsigned long) t->decompressed,
+                   (unsigned long) t->compressed, (unsigned long) t->errors,
+                   t->bytes_in / 1000000000.0, t->bytes_out / 1000000000.0);
+            t->records = t->decompressed = t->compressed = t->errors = t->bytes_in = t->bytes_out = 0;
+            t->tStart = tEnd;
+        }
+    }
+    return (NULL);
+}
+
+void start_codec_threads(void) {
+    int i;
+    codec_threads = calloc(codec_thread_count, sizeof(codec_thread_context_t));
+    for (i = 0; i < codec_thread_count; i++) {
+        codec_thread_context_t *t = &codec_threads[i];
+        pthread_t thread;
+        t->index = i;
+        t->in_queue = stage_queue_create(&codec_stage, 100);
+        t->pool = pool_depth > 0 ? stream_pool_create(pool_depth) : NULL;
+        pthread_create(&thread, NULL, codec_thread, (void *) t);
+        pthread_detach(thread);
+    }
+}
+
+worker_thread_context_t *connection_create(int socket) {
+    worker_thread_context_t *ctx;
+    // Create a worker thread structure
+    ctx = (worker_thread_context_t *) malloc(sizeof(worker_thread_context_t));
+    assert(ctx != 0);
+    bzero(ctx, sizeof(worker_thread_context_t));
+    ctx->socket = socket;
+    ctx->reader.size = staging_size;
+    ctx->reader.data = malloc(staging_size);
+    assert(ctx->reader.data != NULL);
+    return ctx;
+}
+
+void connection_register(worker_thread_context_t *ctx) {
+    clock_gettime(CLOCK_MONOTONIC, &ctx->tStart);
+    pthread_mutex_lock(&connections_lock);
+    ctx->next = connections;
+    connections = ctx;
+    connection_count++;
+    ctx->registered = TRUE;
+    pthread_mutex_unlock(&connections_lock);
+}
+
+void connection_unregister(worker_thread_context_t *ctx) {
+    worker_thread_context_t **p;
+    pthread_mutex_lock(&connections_lock);
+    for (p = &connections; *p != NULL; p = &(*p)->next)
+        if (*p == ctx) {
+            *p = ctx->next;
+            connection_count--;
+            break;
+        }
+    ctx->registered = FALSE;
+    pthread_mutex_unlock(&connections_lock);
+}
+
+// With -s print each connection's rates every 10 seconds, off the data path.
+void *stats_thread(void *arg) {
+    struct timespec now, tDiff;
+    worker_thread_context_t *ctx;
+    for (;;) {
+        sleep(1);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pthread_mutex_lock(&connections_lock);
+        for (ctx = connections; ctx != NULL; ctx = ctx->next) {
+            time_subtract(&tDiff, &now, &ctx->tStart);
+            double tDiffDouble = tDiff.tv_sec + tDiff.tv_nsec / 1000000000.0;
+            if (tDiffDouble < 10.0)
+                continue;
+            uint64_t records = atomic_load_explicit(&ctx->records, memory_order_relaxed);
+            uint64_t bytes = atomic_load_explicit(&ctx->bytes, memory_order_relaxed);
+            printf("ID %08X - buffer rate %.2f Hz, data rate %.6f GByte/s \n", ctx->source_id,
+                   (records - ctx->last_records) / tDiffDouble,
+                   (bytes - ctx->last_bytes) / (tDiffDouble * 1000000000.0));
+            print_pool_stats(ctx);
+            stream_sequence_print(&ctx->sequence);
+            ctx->last_records = records;
+            ctx->last_bytes = bytes;
+            ctx->tStart = now;
+        }
+        pthread_mutex_unlock(&connections_lock);
+    }
+    return (NULL);
+}
+
+void connection_destroy(worker_thread_context_t *ctx) {
+    if (ctx->registered)
+        connection_unregister(ctx);
+    if (ctx->buf != NULL) {
+        printf("Worker thread %s left the main thread and buf != NULL, so free(buf)\n", ctx->name);
+        stream_pool_put(ctx->buf);
+    }
+    if (ctx->state > CONN_ID) {
+        print_pool_stats(ctx);
+        stream_sequence_print(&ctx->sequence);
+    }
+    if (ctx->latency != NULL) {
+        if (!ctx->summarised)
+            stream_latency_summary(ctx->latency);
+        stream_latency_destroy(ctx->latency);
+    }
     printf("Worker thread %s ends -------\n", ctx->name);
     shutdown(ctx->socket, SHUT_RDWR);
+    close(ctx->socket);
+    // Buffers still queued or inside ZMQ keep the pool alive until they come back.
+    stream_pool_destroy(ctx->pool);
+    free(ctx->reader.data);
     free(ctx);
+}
+
+// A record has been read in full. Check it, count it and pass it on to the output thread.
+// Returns -1 if the connection should be closed.
+int record_complete(worker_thread_context_t *ctx, stream_buffer_t *buf) {
+    // Handle statistics, the stats thread turns them into rates
+    counter_add(&ctx->records, 1);
+    counter_add(&ctx->bytes, buf->total_length);
+    if (do_debug > 0)
+        printf("read %d bytes of data\n", buf->total_length);
+    if (buf->magic != CODA_MAGIC)
+        printf("Magic number error %08x should be %08x\n", buf->magic, CODA_MAGIC);
+    if (do_debug > 1)
+        print_data_hex((uint8_t *) buf, buf->total_length);
+    if (do_debug > 0)
+        printf("read ID from block header %08X\n", buf->source_id);
+    if (buf->source_id != ctx->source_id) {
+        printf("*** ID from block header %08X != ID from connect %08X\n", buf->source_id, ctx->source_id);
+        return -1;
+    }
+    stream_sequence_result_t seq = stream_sequence_check(&ctx->sequence, buf->record_counter);
+    if (seq != STREAM_SEQ_OK)
+        stream_sequence_alert(&ctx->sequence, seq, buf->record_counter);
+    if (ctx->latency != NULL) {
+        // Everything parsed from one read arrived together, one clock read covers it
+        if (!ctx->stamped) {
+            stream_clock_now(buf->flags, &ctx->now);
+            ctx->stamped = TRUE;
+        }
+        stream_latency_record(ctx->latency, buf, &ctx->now);
+        stream_latency_tick(ctx->latency);
+    }
+    if (do_debug > 0)
+        printf("Add buffer to output stream\n");
+    // we give up ownership of the buffer
+    if (do_codec)
+        stage_add(&codec_stage, buf->source_id % codec_thread_count, buf);
+    else
+        output_add(buf);
+    return 0;
+}
+
+// Parse as much of data[0..len) as possible. Returns the number of bytes consumed, which
+// is less than len only when what is left is a partial header, or -1 if the connection
+// should be closed.
+ssize_t connection_parse(worker_thread_context_t *ctx, const uint8_t *data, size_t len) {
+    const uint8_t *start = data;
+    ctx->stamped = FALSE;
+    for (;;) {
+        uint32_t word, block_length;
+        switch (ctx->state) {
+            case CONN_MAGIC:
+                // First thing on the socket is the magic number
+                if (len < 4)
+                    return data - start;
+                memcpy(&word, data, 4);
+                data += 4;
+                len -= 4;
+                if (word != CODA_MAGIC) {
+                    printf("*** Spurious connect attempt *** : magic read %08x\n", word);
+                    return -1;
+                }
+                ctx->state = CONN_ID;
+                break;
+            case CONN_ID:
+                // Second thing on the socket is the source ID
+                if (len < 4)
+                    return data - start;
+                memcpy(&ctx->source_id, data, 4);
+                data += 4;
+                len -= 4;
+                sprintf(ctx->name, "%08X", ctx->source_id);
+                ctx->sequence.source_id = ctx->source_id;
+                printf("Worker thread %s starts -------\n", ctx->name);
+                if (pool_depth > 0)
+                    ctx->pool = stream_pool_create(pool_depth);
+                if (do_latency)
+                    ctx->latency = stream_latency_create("ingest", LATENCY_INTERVAL);
+                connection_register(ctx);
+                ctx->state = CONN_HEADER;
+                break;
+            case CONN_HEADER:
+                // Read the ID and length from the block header.
+                if (len < 8)
+                    return data - start;
+                memcpy(&word, data, 4);
+                memcpy(&block_length, data + 4, 4);
+                data += 8;
+                len -= 8;
+                if (do_debug > 0)
+                    printf(" \tID = %08X\n\tlength = %d\n", word, block_length);
+                if (block_length < sizeof(stream_buffer_t)) {
+                    printf("*** Worker thread %s read impossible record length %d\n", ctx->name, block_length);
+                    return -1;
+                }
+                // Here we take ownership of memory so we have to return it to the pool somewhere.
+                ctx->buf = (stream_buffer_t *) stream_pool_get(ctx->pool, block_length);
+                if (ctx->buf == NULL) {
+                    printf("Worker thread %s cannot allocate buffer of %d bytes\n", ctx->name, block_length);
+                    return -1;
+                }
+                ctx->buf->source_id = word;
+                ctx->buf->total_length = block_length;
+                ctx->filled = 8;
+                ctx->state = CONN_BODY;
+                break;
+            case CONN_BODY: {
+                size_t n = ctx->buf->total_length - ctx->filled;
+                if (n > len)
+                    n = len;
+                memcpy((uint8_t *) ctx->buf + ctx->filled, data, n);
+                data += n;
+                len -= n;
+                ctx->filled += n;
+                if (ctx->filled < ctx->buf->total_length)
+                    return data - start;
+                stream_buffer_t *buf = ctx->buf;
+                ctx->buf = NULL;
+                ctx->state = CONN_HEADER;
+                if (record_complete(ctx, buf) < 0) {
+                    stream_pool_put(buf);
+                    return -1;
+                }
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+}
+
+// Parse whatever is in the staging buffer.
+int connection_parse_staged(worker_thread_context_t *ctx) {
+    stream_reader_t *r = &ctx->reader;
+    ssize_t n = connection_parse(ctx, r->data + r->start, r->end - r->start);
+    if (n < 0)
+        return -1;
+    r->start += n;
+    return 0;
+}
+
+// Parse data that was received somewhere other than the staging buffer. Only a partial
+// header left at the end is copied to the staging buffer, to be completed by the next call.
+int connection_feed(worker_thread_context_t *ctx, const uint8_t *data, size_t len) {
+    stream_reader_t *r = &ctx->reader;
+    while (len > 0 && r->end > r->start) {
+        // Top up the carried over bytes until the parser can make progress with them.
+        size_t staged = r->end - r->start;
+        memmove(r->data, r->data + r->start, staged);
+        r->start = 0;
+        r->end = staged + 1;
+        r->data[staged] = *data++;
+        len--;
+        if (connection_parse_staged(ctx) < 0)
+            return -1;
+    }
+    ssize_t n = connection_parse(ctx, data, len);
+    if (n < 0)
+        return -1;
+    r->start = 0;
+    r->end = len - n;
+    memcpy(r->data, data + n, r->end);
+    return 0;
+}
+
+// Read from the socket and parse until the socket has nothing more to give. A blocking
+// socket only returns from here when the connection closes, a non-blocking one returns 0
+// when read() would block. Returns -1 if the connection should be closed.
+int connection_drain(worker_thread_context_t *ctx) {
+    stream_reader_t *r = &ctx->reader;
+    while (keep_going) {
+        if (connection_parse_staged(ctx) < 0)
+            return -1;
+        ssize_t n;
+        size_t body_left = ctx->state == CONN_BODY ? ctx->buf->total_length - ctx->filled : 0;
+        if (body_left >= r->size / 2) {
+            // Big record, read straight into it since staging would only add a copy.
+            n = read(ctx->socket, (uint8_t *) ctx->buf + ctx->filled, body_left);
+            if (n > 0)
+                ctx->filled += n;
+        }
+        else {
+            // Keep the few bytes of a partial header and refill the rest of the staging buffer.
+            size_t staged = r->end - r->start;
+            memmove(r->data, r->data + r->start, staged);
+            r->start = 0;
+            r->end = staged;
+            n = read(ctx->socket, r->data + r->end, r->size - r->end);
+            if (n > 0)
+                r->end += n;
+        }
+        if (n > 0)
+            continue;
+        if (n == 0)
+            return -1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno != EINTR)
+            return -1;
+    }
+    return -1;
+}
+
+// One thread per connection with blocking reads.
+void *worker_routine(void *arg) {
+    worker_thread_context_t *ctx = arg;
+    ctx->thread = pthread_self();
+    connection_drain(ctx);
+    connection_destroy(ctx);
     return 0;
 }
 
+// Event loop mode. Each I/O thread owns an epoll set and services every connection the
+// main thread hands it. Sockets are non-blocking and edge triggered, so each one is
+// drained until read() would block whenever epoll reports it readable.
+#define EPOLL_BATCH 64
+
+int io_thread_count = 0;
+int *io_epoll_fds;
+
+void *io_thread(void *arg) {
+    int efd = *(int *) arg;
+    struct epoll_event events[EPOLL_BATCH];
+    printf("I/O thread starts -------\n");
+    while (keep_going) {
+        int i, n = epoll_wait(efd, events, EPOLL_BATCH, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait error");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            worker_thread_context_t *ctx = events[i].data.ptr;
+            if (connection_drain(ctx) < 0) {
+                epoll_ctl(efd, EPOLL_CTL_DEL, ctx->socket, NULL);
+                connection_destroy(ctx);
+            }
+        }
+    }
+    printf("I/O thread ends -------\n");
+    return (NULL);
+}
+
+void start_io_threads(void) {
+    int i;
+    io_epoll_fds = calloc(io_thread_count, sizeof(int));
+    for (i = 0; i < io_thread_count; i++) {
+        pthread_t thread;
+        io_epoll_fds[i] = epoll_create1(0);
+        if (io_epoll_fds[i] < 0) {
+            perror("epoll_create1 error");
+            exit(1);
+        }
+        pthread_create(&thread, NULL, io_thread, &io_epoll_fds[i]);
+    }
+}
+
+// Connections are spread round robin over the I/O threads.
+void add_to_io_thread(worker_thread_context_t *ctx) {
+    static int next = 0;
+    struct epoll_event ev;
+    fcntl(ctx->socket, F_SETFL, fcntl(ctx->socket, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = ctx;
+    if (epoll_ctl(io_epoll_fds[next], EPOLL_CTL_ADD, ctx->socket, &ev) < 0) {
+        perror("epoll_ctl error");
+        connection_destroy(ctx);
+        return;
+    }
+    next = (next + 1) % io_thread_count;
+}
+
+// io_uring mode. Each ring thread keeps a multishot receive armed on every connection it
+// owns, the kernel picks a buffer from the thread's provided buffer ring for each chunk of
+// data and one io_uring_enter submits new work and reaps every completion that is ready.
+// New connections are passed from the main thread on a queue and announced on an eventfd
+// that the ring keeps a read posted on. A periodic timeout lets the thread notice
+// keep_going and print statistics.
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE (64 * 1024)
+#define URING_WAKEUP 1
+#define URING_TICK 2
+
+typedef struct uring_thread_context {
+    int index;
+    stream_uring_t ring;
+    int event_fd;
+    uint64_t event_count;
+    struct __kernel_timespec tick;
+    stream_rb_t *new_connections;
+    int multishot;
+    // Statistics
+    uint64_t records;
+    uint64_t completions;
+    uint64_t batches;
+    struct timespec tStart;
+} uring_thread_context_t;
+
+int uring_mode = 0;
+uring_thread_context_t *uring_threads;
+
+struct io_uring_sqe *uring_sqe(uring_thread_context_t *t) {
+    struct io_uring_sqe *sqe;
+    // Submission queue full, push what is there to the kernel to make room.
+    while ((sqe = stream_uring_get_sqe(&t->ring)) == NULL)
+        stream_uring_submit_and_wait(&t->ring, 0);
+    return sqe;
+}
+
+void uring_arm_recv(uring_thread_context_t *t, worker_thread_context_t *ctx) {
+    struct io_uring_sqe *sqe = uring_sqe(t);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ctx->socket;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = t->ring.buf_group;
+    if (t->multishot)
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = (uint64_t) (uintptr_t) ctx;
+}
+
+void uring_arm_wakeup(uring_thread_context_t *t) {
+    struct io_uring_sqe *sqe = uring_sqe(t);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = t->event_fd;
+    sqe->addr = (uint64_t) (uintptr_t) &t->event_count;
+    sqe->len = sizeof(t->event_count);
+    sqe->user_data = URING_WAKEUP;
+}
+
+void uring_arm_tick(uring_thread_context_t *t) {
+    struct io_uring_sqe *sqe = uring_sqe(t);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t) (uintptr_t) &t->tick;
+    sqe->len = 1;
+    sqe->user_data = URING_TICK;
+}
+
+void print_uring_stats(uring_thread_context_t *t) {
+    printf("io_uring thread %d - %lu records, %.4f syscalls/record, %.2f completions/batch\n", t->index,
+           (unsigned long) t->records, t->records ? (double) t->ring.enters / t->records : 0.0,
+           t->batches ? (double) t->completions / t->batches : 0.0);
+}
+
+// One receive completion for ctx. Returns -1 once the connection is finished with.
+int uring_complete_recv(uring_thread_context_t *t, worker_thread_context_t *ctx, int res, unsigned flags) {
+    if (res > 0) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (ctx->state != CONN_CLOSED) {
+            uint64_t before = ctx->records;
+            if (connection_feed(ctx, stream_uring_buffer(&t->ring, bid), res) < 0) {
+                // Stop the multishot receive, its final completion releases ctx.
+                ctx->state = CONN_CLOSED;
+                shutdown(ctx->socket, SHUT_RDWR);
+            }
+            t->records += ctx->records - before;
+        }
+        stream_uring_buffer_return(&t->ring, bid);
+    }
+    else if (res == -EINVAL && t->multishot) {
+        // Kernels before 6.0 take provided buffers but not multishot receives.
+        printf("io_uring multishot receive not supported, using single shot\n");
+        t->multishot = 0;
+        uring_arm_recv(t, ctx);
+        return 0;
+    }
+    if (flags & IORING_CQE_F_MORE)
+        return 0;
+    // Receive is no longer armed. It ends after every completion in single shot mode or
+    // when multishot ran out of provided buffers, re-arm unless the connection is done.
+    if (ctx->state != CONN_CLOSED && (res > 0 || res == -ENOBUFS)) {
+        uring_arm_recv(t, ctx);
+        return 0;
+    }
+    return -1;
+}
+
+void *uring_thread(void *arg) {
+    uring_thread_context_t *t = arg;
+    printf("io_uring thread %d starts -------\n", t->index);
+    uring_arm_wakeup(t);
+    uring_arm_tick(t);
+    clock_gettime(CLOCK_REALTIME, &t->tStart);
+    while (keep_going) {
+        struct io_uring_cqe *cqe;
+        int ret = stream_uring_submit_and_wait(&t->ring, 1);
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY) {
+            printf("io_uring_enter error: %s\n", strerror(-ret));
+            break;
+        }
+        uint64_t reaped = 0;
+        while ((cqe = stream_uring_peek_cqe(&t->ring)) != NULL) {
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            stream_uring_cqe_seen(&t->ring);
+            reaped++;
+            if (tag == URING_WAKEUP) {
+                worker_thread_context_t *ctx;
+                while ((ctx = stream_queue_try_get(t->new_connections)) != NULL)
+                    uring_arm_recv(t, ctx);
+                uring_arm_wakeup(t);
+            }
+            else if (tag == URING_TICK) {
+                struct timespec tNow, tDiff;
+                clock_gettime(CLOCK_REALTIME, &tNow);
+                time_subtract(&tDiff, &tNow, &t->tStart);
+                if (do_stats && tDiff.tv_sec >= 10) {
+                    print_uring_stats(t);
+                    t->tStart = tNow;
+                }
+                uring_arm_tick(t);
+            }
+            else {
+                worker_thread_context_t *ctx = (worker_thread_context_t *) (uintptr_t) tag;
+                if (uring_complete_recv(t, ctx, res, flags) < 0)
+                    connection_destroy(ctx);
+            }
+        }
+        if (reaped > 0) {
+            t->completions += reaped;
+            t->batches++;
+        }
+    }
+    print_uring_stats(t);
+    printf("io_uring thread %d ends -------\n", t->index);
+    return (NULL);
+}
+
+// Returns -1 if io_uring, or a ring of provided buffers, isn't available here.
+int start_uring_threads(void) {
+    int i;
+    uring_threads = calloc(io_thread_count, sizeof(uring_thread_context_t));
+    for (i = 0; i < io_thread_count; i++) {
+        uring_thread_context_t *t = &uring_threads[i];
+        int ret = stream_uring_init(&t->ring, URING_ENTRIES);
+        if (ret == 0) {
+            ret = stream_uring_setup_buffers(&t->ring, URING_BUFFERS, URING_BUFFER_SIZE, 0);
+            if (ret < 0)
+                stream_uring_exit(&t->ring);
+        }
+        if (ret < 0) {
+            printf("io_uring not available (%s)\n", strerror(-ret));
+            // Nothing has started yet, undo the threads that were set up
+            while (--i >= 0) {
+                stream_uring_exit(&uring_threads[i].ring);
+                close(uring_threads[i].event_fd);
+                stream_queue_destroy(uring_threads[i].new_connections);
+            }
+            free(uring_threads);
+            uring_threads = NULL;
+            return -1;
+        }
+        t->index = i;
+        t->multishot = 1;
+        t->tick.tv_sec = 1;
+        t->event_fd = eventfd(0, 0);
+        t->new_connections = stream_queue_create(1024, STREAM_QUEUE_MPSC, STREAM_WAIT_SLEEP);
+    }
+    for (i = 0; i < io_thread_count; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, uring_thread, &uring_threads[i]);
+    }
+    return 0;
+}
+
+// Connections are spread round robin over the ring threads.
+void add_to_uring_thread(worker_thread_context_t *ctx) {
+    static int next = 0;
+    uint64_t one = 1;
+    uring_thread_context_t *t = &uring_threads[next];
+    stream_queue_add(t->new_connections, ctx);
+    if (write(t->event_fd, &one, sizeof(one)) < 0)
+        perror("eventfd write error");
+    next = (next + 1) % io_thread_count;
+}
+
+// At exit, after keep_going is cleared. An output thread waiting on its queue is woken by
+// output_stop, one that is busy sees keep_going before it takes the next record.
+void stop_output_threads(void) {
+    int i;
+    if (frame_builder != NULL) {
+        pthread_join(frame_builder->thread, NULL);
+        return;
+    }
+    for (i = 0; i < output_thread_count; i++) {
+        stream_queue_try_add(output_threads[i].queue, &output_stop);
+        pthread_join(output_threads[i].thread, NULL);
+    }
+}
+
+// Latency since the start. Connections that have closed printed their ingest summary
+// then, the ones still open are copied from their live tables. Publish latency is only
+// printed once the output threads have stopped.
+void print_latency_summary(void) {
+    static stream_hist_t h;
+    worker_thread_context_t *ctx;
+    char label[64];
+    int i;
+    if (!do_latency)
+        return;
+    pthread_mutex_lock(&connections_lock);
+    for (ctx = connections; ctx != NULL; ctx = ctx->next) {
+        if (ctx->latency == NULL)
+            continue;
+        int count = stream_latency_count(ctx->latency);
+        for (i = 0; i < count; i++) {
+            uint32_t source_id = stream_latency_snapshot(ctx->latency, i, &h);
+            snprintf(label, sizeof(label), "ID %08X %s latency summary", source_id, ctx->latency->name);
+            stream_hist_print(label, &h);
+        }
+        ctx->summarised = TRUE;
+    }
+    pthread_mutex_unlock(&connections_lock);
+    if (frame_builder != NULL)
+        stream_latency_summary(frame_builder->latency);
+    else
+        for (i = 0; i < output_thread_count; i++)
+            stream_latency_summary(output_threads[i].latency);
+}
+
+// Quantiles of a latency table, each source's histogram since the start plus what the
+// owning thread has recorded since its last report, copied under the table's lock.
+void metrics_latency(stream_metrics_text_t *text, stream_latency_t *l, const char *labels) {
+    static stream_hist_t h;
+    static const double quantiles[] = {50.0, 99.0, 99.9};
+    int i, q, count;
+    if (l == NULL)
+        return;
+    count = stream_latency_count(l);
+    for (i = 0; i < count; i++) {
+        uint32_t source_id = stream_latency_snapshot(l, i, &h);
+        for (q = 0; q < 3; q++)
+            stream_metrics_printf(text, "stream_router_latency_seconds{source=\"%08X\",point=\"%s\"%s,quantile=\"%g\"} %.9f\n",
+                                  source_id, l->name, labels, quantiles[q] / 100.0,
+                                  stream_hist_percentile(&h, quantiles[q]) / 1e9);
+        stream_metrics_printf(text, "stream_router_latency_seconds_count{source=\"%08X\",point=\"%s\"%s} %lu\n",
+                              source_id, l->name, labels, (unsigned long) h.count);
+    }
+}
+
+void metrics_stage(stream_metrics_text_t *text, stage_t *s) {
+    int i;
+    for (i = 0; i < s->lane_count; i++)
+        stream_metrics_printf(text, "stream_router_queue_depth{stage=\"%s\",queue=\"%d\"} %d\n",
+                              s->name, i, stream_queue_count(s->lanes[i]->queue));
+}
+
+// Render every metric for a scrape. Counters are read as they are, nothing is reset.
+void metrics_render(stream_metrics_text_t *text, void *arg) {
+    worker_thread_context_t *ctx;
+    stage_t *stages[2] = {&output_stage, &codec_stage};
+    int i, stage_count = do_codec ? 2 : 1;
+    pthread_mutex_lock(&connections_lock);
+    stream_metrics_header(text, "stream_router_connections", "gauge", "Connected sources");
+    stream_metrics_printf(text, "stream_router_connections %d\n", connection_count);
+    stream_metrics_header(text, "stream_router_received_records_total", "counter", "Records received per source");
+    for (ctx = connections; ctx != NULL; ctx = ctx->next)
+        stream_metrics_printf(text, "stream_router_received_records_total{source=\"%08X\"} %lu\n", ctx->source_id,
+                              (unsigned long) atomic_load_explicit(&ctx->records, memory_order_relaxed));
+    stream_metrics_header(text, "stream_router_received_bytes_total", "counter", "Bytes received per source");
+    for (ctx = connections; ctx != NULL; ctx = ctx->next)
+        stream_metrics_printf(text, "stream_router_received_bytes_total{source=\"%08X\"} %lu\n", ctx->source_id,
+                              (unsigned long) atomic_load_explicit(&ctx->bytes, memory_order_relaxed));
+    stream_metrics_header(text, "stream_router_missing_records_total", "counter", "Records skipped by record_counter per source");
+    for (ctx = connections; ctx != NULL; ctx = ctx->next)
+        stream_metrics_printf(text, "stream_router_missing_records_total{source=\"%08X\"} %lu\n", ctx->source_id,
+                              (unsigned long) ctx->sequence.missing);
+    stream_metrics_header(text, "stream_router_sequence_anomalies_total", "counter", "Gaps, reordered and duplicate records and restarts per source");
+    for (ctx = connections; ctx != NULL; ctx = ctx->next) {
+        stream_sequence_t *seq = &ctx->sequence;
+        stream_metrics_printf(text, "stream_router_sequence_anomalies_total{source=\"%08X\",kind=\"gap\"} %lu\n"
+                                    "stream_router_sequence_anomalies_total{source=\"%08X\",kind=\"reordered\"} %lu\n"
+                                    "stream_router_sequence_anomalies_total{source=\"%08X\",kind=\"duplicate\"} %lu\n"
+                                    "stream_router_sequence_anomalies_total{source=\"%08X\",kind=\"restart\"} %lu\n",
+                              ctx->source_id, (unsigned long) seq->gaps, ctx->source_id, (unsigned long) seq->reordered,
+                              ctx->source_id, (unsigned long) seq->duplicates, ctx->source_id, (unsigned long) seq->restarts);
+    }
+    stream_metrics_header(text, "stream_router_pool_buffers_total", "counter", "Buffers taken from each connection's pool, hit or malloc'ed on a miss");
+    for (ctx = connections; ctx != NULL; ctx = ctx->next)
+        if (ctx->pool != NULL)
+            stream_metrics_printf(text, "stream_router_pool_buffers_total{source=\"%08X\",result=\"hit\"} %lu\n"
+                                        "stream_router_pool_buffers_total{source=\"%08X\",result=\"miss\"} %lu\n",
+                                  ctx->source_id, (unsigned long) atomic_load(&ctx->pool->hits),
+                                  ctx->source_id, (unsigned long) atomic_load(&ctx->pool->misses));
+    stream_metrics_header(text, "stream_router_pool_high_water", "gauge", "Most buffers out of each connection's pool at once");
+    for (ctx = connections; ctx != NULL; ctx = ctx->next)
+        if (ctx->pool != NULL)
+            stream_metrics_printf(text, "stream_router_pool_high_water{source=\"%08X\"} %d\n",
+                                  ctx->source_id, atomic_load(&ctx->pool->high_water));
+    if (do_latency) {
+        stream_metrics_header(text, "stream_router_latency_seconds", "summary", "Time from the record timestamp to ingest and publish");
+        for (ctx = connections; ctx != NULL; ctx = ctx->next)
+            metrics_latency(text, ctx->latency, "");
+    }
+    pthread_mutex_unlock(&connections_lock);
+    if (do_latency) {
+        if (frame_builder != NULL)
+            metrics_latency(text, frame_builder->latency, "");
+        else
+            for (i = 0; i < output_thread_count; i++) {
+                char labels[32];
+                snprintf(labels, sizeof(labels), ",output=\"%d\"", i);
+                metrics_latency(text, output_threads[i].latency, labels);
+            }
+    }
+    stream_metrics_header(text, "stream_router_published_records_total", "counter", "Records handed to ZeroMQ per output thread");
+    if (frame_builder != NULL)
+        stream_metrics_printf(text, "stream_router_published_records_total{output=\"frames\"} %lu\n",
+                              (unsigned long) atomic_load(&frame_builder->published));
+    else
+        for (i = 0; i < output_thread_count; i++)
+            stream_metrics_printf(text, "stream_router_published_records_total{output=\"%d\"} %lu\n", i,
+                                  (unsigned long) atomic_load(&output_threads[i].published));
+    stream_metrics_header(text, "stream_router_published_bytes_total", "counter", "Bytes handed to ZeroMQ per output thread");
+    if (frame_builder != NULL)
+        stream_metrics_printf(text, "stream_router_published_bytes_total{output=\"frames\"} %lu\n",
+                              (unsigned long) atomic_load(&frame_builder->published_bytes));
+    else
+        for (i = 0; i < output_thread_count; i++)
+            stream_metrics_printf(text, "stream_router_published_bytes_total{output=\"%d\"} %lu\n", i,
+                                  (unsigned long) atomic_load(&output_threads[i].published_bytes));
+    stream_metrics_header(text, "stream_router_queue_depth", "gauge", "Records waiting in each queue between stages");
+    for (i = 0; i < stage_count; i++)
+        metrics_stage(text, stages[i]);
+    stream_metrics_header(text, "stream_router_dropped_records_total", "counter", "Records dropped by each stage's overflow policy");
+    for (i = 0; i < stage_count; i++)
+        stream_metrics_printf(text, "stream_router_dropped_records_total{stage=\"%s\"} %lu\n", stages[i]->name,
+                              (unsigned long) atomic_load(&stages[i]->dropped));
+    stream_metrics_header(text, "stream_router_dropped_bytes_total", "counter", "Bytes dropped by each stage's overflow policy");
+    for (i = 0; i < stage_count; i++)
+        stream_metrics_printf(text, "stream_router_dropped_bytes_total{stage=\"%s\"} %lu\n", stages[i]->name,
+                              (unsigned long) atomic_load(&stages[i]->dropped_bytes));
+    stream_metrics_header(text, "stream_router_spilled_records_total", "counter", "Records written to and replayed from the spill journals");
+    for (i = 0; i < stage_count; i++)
+        stream_metrics_printf(text, "stream_router_spilled_records_total{stage=\"%s\",direction=\"out\"} %lu\n"
+                                    "stream_router_spilled_records_total{stage=\"%s\",direction=\"in\"} %lu\n",
+                              stages[i]->name, (unsigned long) atomic_load(&stages[i]->spilled),
+                              stages[i]->name, (unsigned long) atomic_load(&stages[i]->replayed));
+    if (tap_url != NULL) {
+        stream_metrics_header(text, "stream_router_tap_records_total", "counter", "Records sampled by the tap and what became of them");
+        stream_metrics_printf(text, "stream_router_tap_records_total{result=\"sampled\"} %lu\n"
+                                    "stream_router_tap_records_total{result=\"sent\"} %lu\n"
+                                    "stream_router_tap_records_total{result=\"queue_full\"} %lu\n"
+                                    "stream_router_tap_records_total{result=\"rate_limit\"} %lu\n",
+                              (unsigned long) atomic_load(&tap_sampled), (unsigned long) tap_sent,
+                              (unsigned long) atomic_load(&tap_queue_drops), (unsigned long) tap_rate_drops);
+    }
+}
+
 void cc_handler(int signum) {
     keep_going = 0;
     close(server_socket);
     shutdown(server_socket, SHUT_RDWR);
-    printf ("\nStream shutdown due to signal %s\n", sys_siglist[signum]);
+    printf ("\nStream shutdown due to signal %s\n", strsignal(signum));
 }
 
 // Give the poor user some help on command line options.
@@ -209,9 +2011,33 @@ void print_options(char *pname) {
     printf("\t-z: use zmq for output\n");
     //printf("\t-m: use mpi for output\n");
     printf("\t-s: print statistics every 10s\n");
+    printf("\t-E <endpoint>: serve Prometheus metrics over HTTP on a port, host:port or Unix socket path\n");
+    printf("\t-l: print latency from the record timestamps at ingest and publish every 10s and at the end\n");
     printf("\t-p <port>: specify a port [default: 5555]\n");
     printf("\t-u <url>: specify url to publish on [default: tcp://*:5556]\n");
     printf("\t-b <bytes>: specify TCP receive buffer size\n");
+    printf("\t-w <wait>: queue wait strategy sleep|spin|yield|block [default: sleep]\n");
+    printf("\t-P <buffers>: free buffers kept per size class per connection, 0 = malloc [default: 32]\n");
+    printf("\t-B <bytes>: per connection receive staging buffer size [default: 262144]\n");
+    printf("\t-e: serve all connections from a fixed pool of epoll I/O threads\n");
+    printf("\t-U: receive with io_uring ring threads, falls back to a thread per connection if unsupported\n");
+    printf("\t-t <threads>: number of I/O threads with -e or -U [default: number of cores]\n");
+    printf("\t-c <codec[:level]>: publish payloads with codec none, lz4, zstd or snappy [default: as received]\n");
+    printf("\t-C <threads>: number of codec threads with -c [default: 4]\n");
+    printf("\t-o <threads>: number of output threads, each publishes on its own port counting up from the -u port [default: 1]\n");
+    printf("\t-q <depth>: depth of each output queue [default: 100]\n");
+    printf("\t-D <policy>: when a queue is full block, drop-newest, drop-oldest or spill, for every stage or as codec=<policy>,output=<policy> [default: block]\n");
+    printf("\t-J <path>: spill journal files are <path>-<stage>-<queue>-<n>.journal\n");
+    printf("\t-j <MB>: most disk space all the spill journals may use [default: 1024]\n");
+    printf("\t-F <us>: publish records from all sources in time frames of this many microseconds of timestamp\n");
+    printf("\t-N <records>: publish records from all sources in frames of this many records of record_counter\n");
+    printf("\t-L <ms>: with -F or -N publish a frame this long after it opened even if sources are missing [default: 100]\n");
+    printf("\t-M <policy>: frames with sources missing are publish-ed or drop-ped [default: publish]\n");
+    printf("\t-x: accept filters from subscribers and apply them before publishing\n");
+    printf("\t-T <url>: publish a sample of the records for monitoring on this URL\n");
+    printf("\t-S <n>: the tap samples one in every n records [default: 100]\n");
+    printf("\t-R <hz>: most records per second the tap publishes [default: no limit]\n");
+    printf("\t-H <bytes>: most payload bytes in each tap record, 0 = header only [default: all]\n");
 }
 
 int main(int argc, char **argv) {
@@ -223,7 +2049,7 @@ int main(int argc, char **argv) {
         printf("\tExecuting with command line options\n\t");
         
         char opt;
-        while ((opt = getopt(argc, argv, "mzvp:su:b:")) != -1) {
+        while ((opt = getopt(argc, argv, "mzvp:slE:u:b:w:P:B:eUt:c:C:o:q:D:J:j:F:N:L:M:xT:S:R:H:")) != -1) {
             switch (opt) {
                 case 'v':
                     // Log to stdout
@@ -233,6 +2059,33 @@ int main(int argc, char **argv) {
                 case 'z':
                     zmq_mode = 1;
                     break;
+                case 'x':
+                    do_filters = 1;
+                    break;
+                case 'T':
+                    tap_url = strdup(optarg);
+                    break;
+                case 'S':
+                    tap_every = atoi(optarg);
+                    if (tap_every < 1) {
+                        printf("invalid tap sample = %s, must be > 0.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'R':
+                    tap_rate = atoi(optarg);
+                    if (tap_rate < 0) {
+                        printf("invalid tap rate = %s, must be >= 0.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'H':
+                    tap_payload = atoi(optarg);
+                    if (tap_payload < 0) {
+                        printf("invalid tap payload = %s, must be >= 0.\n", optarg);
+                        exit(0);
+                    }
+                    break;
                 case 'p':
                     // Send to this port.
                 {
@@ -253,6 +2106,12 @@ int main(int argc, char **argv) {
                     // Send to this port.
                     do_stats = 1;
                     break;
+                case 'l':
+                    do_latency = 1;
+                    break;
+                case 'E':
+                    metrics_endpoint = strdup(optarg);
+                    break;
                 case 'u':
                     publisher = strdup(optarg);
                     break;
@@ -264,6 +2123,114 @@ int main(int argc, char **argv) {
                     }
                     printf("Set TCP receive buf size to %d bytes\n\t", rcvBufSize);
                     break;
+                case 'w': {
+                    int w = stream_wait_from_name(optarg);
+                    if (w < 0) {
+                        printf("invalid wait strategy = %s\n", optarg);
+                        exit(0);
+                    }
+                    wait_strategy = w;
+                    break;
+                }
+                case 'e':
+                    epoll_mode = 1;
+                    break;
+                case 'U':
+                    uring_mode = 1;
+                    break;
+                case 't':
+                    io_thread_count = atoi(optarg);
+                    if (io_thread_count < 1) {
+                        printf("invalid number of I/O threads = %s, must be > 0.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'B':
+                    staging_size = atoi(optarg);
+                    if (staging_size < 64) {
+                        printf("invalid staging buffer size = %s, must be >= 64.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'c':
+                    if (stream_codec_parse(optarg, &publish_codec, &publish_level) < 0) {
+                        printf("unknown or unsupported codec %s\n", optarg);
+                        exit(0);
+                    }
+                    do_codec = 1;
+                    break;
+                case 'C':
+                    codec_thread_count = atoi(optarg);
+                    if (codec_thread_count < 1) {
+                        printf("invalid number of codec threads = %s, must be > 0.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'o':
+                    output_thread_count = atoi(optarg);
+                    if (output_thread_count < 1) {
+                        printf("invalid number of output threads = %s, must be > 0.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'q':
+                    out_queue_depth = atoi(optarg);
+                    if (out_queue_depth < 1) {
+                        printf("invalid output queue depth = %s, must be > 0.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'F':
+                case 'N': {
+                    long long window = atoll(optarg);
+                    if (window < 1) {
+                        printf("invalid frame window = %s, must be > 0.\n", optarg);
+                        exit(0);
+                    }
+                    frame_key = opt == 'F' ? FRAME_BY_TIME : FRAME_BY_COUNTER;
+                    frame_window = opt == 'F' ? window * 1000 : window;
+                    break;
+                }
+                case 'L':
+                    frame_timeout_ms = atoi(optarg);
+                    if (frame_timeout_ms < 1) {
+                        printf("invalid frame timeout = %s, must be > 0.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'D':
+                    if (stage_parse(optarg) < 0) {
+                        printf("invalid overflow policy = %s, must be block, drop-newest, drop-oldest or spill.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'J':
+                    journal_path = strdup(optarg);
+                    break;
+                case 'j':
+                    journal_cap = atol(optarg) * 1024UL * 1024;
+                    if (journal_cap == 0) {
+                        printf("invalid journal cap = %s, must be > 0.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'M':
+                    if (strcmp(optarg, "publish") == 0)
+                        frame_drop_incomplete = 0;
+                    else if (strcmp(optarg, "drop") == 0)
+                        frame_drop_incomplete = 1;
+                    else {
+                        printf("invalid missing source policy = %s, must be publish or drop.\n", optarg);
+                        exit(0);
+                    }
+                    break;
+                case 'P':
+                    pool_depth = atoi(optarg);
+                    if (pool_depth < 0) {
+                        printf("invalid pool depth = %s, must be >= 0.\n", optarg);
+                        exit(0);
+                    }
+                    break;
                default:
                     print_options(argv[0]);
                     printf("%s exits\n", argv[0]);
@@ -276,8 +2243,48 @@ int main(int argc, char **argv) {
     printf("TCP stream input port %d\n\t", target_port);
     if (!zmq_mode) printf("NOT Publishing using ZMQ\n\t");
     else printf("Publishing using ZMQ using URL %s\n\t", publisher);
+    if (do_filters) printf("Applying subscriber filters\n\t");
+    if (tap_url != NULL) printf("Tap publishes one in %d records on %s\n\t", tap_every, tap_url);
     if (!do_stats) printf("NOT ");
-    printf("printing stats every 10 seconds.\n");
+    printf("printing stats every 10 seconds.\n\t");
+    if (do_latency) printf("Measuring latency at ingest and publish\n\t");
+    if (metrics_endpoint != NULL) printf("Serving metrics on %s\n\t", metrics_endpoint);
+    printf("Queue wait strategy %s\n\t", stream_wait_name(wait_strategy));
+    if (pool_depth > 0) printf("Buffer pool keeps %d buffers per size class\n\t", pool_depth);
+    else printf("NOT pooling buffers\n\t");
+    if (frame_key != FRAME_OFF) {
+        printf("Building frames of %llu %s, timeout %d ms, %s frames with missing sources\n\t",
+               (unsigned long long) (frame_key == FRAME_BY_TIME ? frame_window / 1000 : frame_window),
+               frame_key == FRAME_BY_TIME ? "us" : "records", frame_timeout_ms,
+               frame_drop_incomplete ? "dropping" : "publishing");
+        if (output_thread_count > 1)
+            printf("The frame builder publishes everything, -o is ignored\n\t");
+    }
+    else
+        printf("%d output threads, output queue depth %d\n\t", output_thread_count, out_queue_depth);
+    if (do_codec) printf("Publishing %s payloads from %d codec threads\n\t", stream_codec_name(publish_codec), codec_thread_count);
+    if (do_codec) printf("Codec queues %s when full\n\t", overflow_names[codec_stage.policy]);
+    printf("Output queues %s when full\n\t", overflow_names[output_stage.policy]);
+    {
+        int lanes = 0;
+        if (do_codec && codec_stage.policy == OVERFLOW_SPILL)
+            lanes += codec_thread_count;
+        if (output_stage.policy == OVERFLOW_SPILL)
+            lanes += frame_key != FRAME_OFF ? 1 : output_thread_count;
+        if (lanes > 0 && journal_path == NULL) {
+            printf("The spill policy needs a journal path, -J\n");
+            exit(0);
+        }
+        if (lanes > 0) {
+            journal_queue_cap = journal_cap / lanes;
+            printf("Spilling to %s-*.journal, at most %lu MB\n\t", journal_path, (unsigned long) (journal_cap >> 20));
+        }
+    }
+    if (io_thread_count == 0)
+        io_thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (uring_mode) printf("Receiving with %d io_uring threads\n", io_thread_count);
+    else if (epoll_mode) printf("Serving connections from %d epoll I/O threads\n", io_thread_count);
+    else printf("One thread per connection\n");
     printf("-------\n\n");
     //  Socket to receive from to sources
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -303,24 +2310,38 @@ int main(int argc, char **argv) {
         exit(1);
     }
     signal(SIGINT, cc_handler);
+    void *context = NULL;
     if (zmq_mode) {
         // Initialize zmq
         zsys_init();
-        void *context = zmq_ctx_new();
+        context = zmq_ctx_new();
+        // One ZMQ I/O thread per output thread
+        zmq_ctx_set(context, ZMQ_IO_THREADS, frame_key != FRAME_OFF ? 1 : output_thread_count);
         int maj, min, pat;
         zmq_version(&maj, &min, &pat);
         printf("\t Will publish data using ZMQ version - %d.%d.%d\n", maj, min, pat);
-        // Create a ZMQ publish socket
-        publish_socket = zmq_socket(context, ZMQ_PUB);
-        if (zmq_bind(publish_socket, publisher) == -1) {
-            printf("%s exits -> ", argv[0]);
-            perror("zmq_bind error :");
-            exit(-1);
-        }
     }
-    out_queue = stream_queue_create(100);
-    pthread_t output;
-    pthread_create(&output, NULL, output_thread, (void *) NULL);
+    if (tap_url != NULL)
+        start_tap(context);
+    if (frame_key != FRAME_OFF)
+        start_frame_builder(context);
+    else
+        start_output_threads(context);
+    if (do_codec)
+        start_codec_threads();
+    if (uring_mode && start_uring_threads() < 0) {
+        printf("Falling back to %s\n", epoll_mode ? "epoll I/O threads" : "one thread per connection");
+        uring_mode = 0;
+    }
+    if (epoll_mode && !uring_mode)
+        start_io_threads();
+    if (do_stats) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, stats_thread, NULL);
+        pthread_detach(thread);
+    }
+    if (metrics_endpoint != NULL && stream_metrics_start(metrics_endpoint, metrics_render, NULL) == NULL)
+        exit(-1);
     signal(SIGINT, cc_handler);
     while (keep_going) {
         struct sockaddr_in from;
@@ -329,7 +2350,8 @@ int main(int argc, char **argv) {
         int connection = accept(server_socket, (struct sockaddr *) &from, (socklen_t *) &slen);
         if (connection > 0) {
             printf("We got a connection from %s\n", inet_ntoa((struct in_addr) from.sin_addr));
-            printf("fire up a thread to handle it,\n");
+            if (uring_mode || epoll_mode) printf("hand it to an I/O thread,\n");
+            else printf("fire up a thread to handle it,\n");
             
             /* set receive buffer size unless default specified by a value <= 0  */
             if (rcvBufSize > 0) {
@@ -347,19 +2369,25 @@ int main(int argc, char **argv) {
                  printf("Actual TCP receive buf size = %d bytes\n", rBufSize);
             }
             
-            worker_thread_context_t *thread_context;
-            // Create a worker thread structure
-            thread_context = (worker_thread_context_t *) malloc(sizeof(worker_thread_context_t));
-            assert(thread_context != 0);
-            bzero(thread_context, sizeof(worker_thread_context_t));
-            pthread_t worker;
-            thread_context->socket = connection;
-            pthread_create(&worker, NULL, worker_routine,
-                           (void *) thread_context);
+            worker_thread_context_t *thread_context = connection_create(connection);
+            if (uring_mode)
+                add_to_uring_thread(thread_context);
+            else if (epoll_mode)
+                add_to_io_thread(thread_context);
+            else {
+                pthread_t worker;
+                pthread_create(&worker, NULL, worker_routine,
+                               (void *) thread_context);
+                pthread_detach(worker);
+            }
         }
         else break;
     }
     close(server_socket);
+    stage_close(&codec_stage);
+    stage_close(&output_stage);
+    stop_output_threads();
+    print_latency_summary();
     printf("%s exits\n", argv[0]);
     exit(0);
 }
@@ -28,6 +28,9 @@
  *
  */
 
+// For CPU_SET and pthread_setaffinity_np
+#define _GNU_SOURCE
+
 // Don't blame me for this list of includes, Eclipse generates it.
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -44,24 +47,89 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <errno.h>
+#include <limits.h>
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include "stream_tools.h"
+#include "stream_codec.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 // We need to store the rates for each cycle. Set up a couple of arrays of doubles.
 // The number of cycles is set by a command line option so malloc storage later.
 int cycle_count = 0;
 double *data_rates, *block_rates;
 
-// We will set up a pool of reusable buffers. This is faster and safer than malloc.
-stream_rb_t *free_buffer_queue;
+// Each stream is one connection to the target with its own source ID, writer thread and
+// pool of reusable buffers. The pool is faster and safer than malloc.
+typedef struct source_stream {
+    int index;
+    uint32_t source_id;
+    int socket;
+    // CPU the writer is pinned to, -1 if not pinned
+    int cpu;
+    stream_rb_t *free_queue;
+    stream_rb_t *out_queue;
+    pthread_t writer;
+    uint64_t next_record;
+    // With compression buffers go round robin through the workers, the main thread hands
+    // them out with next_compressor and the writer collects them with next_collect.
+    struct compression_stream *compressors;
+    int next_compressor;
+    int next_collect;
+    // Statistics, updated by the writer
+    _Atomic uint64_t records_sent;
+    _Atomic uint64_t bytes_sent;
+    uint64_t last_records;
+    uint64_t last_bytes;
+} source_stream_t;
+
+// Number of parallel streams. Overridden by the -ns option
+int stream_count = 1;
+source_stream_t *streams;
+// Stream the next record goes to, records are dealt out to the streams in turn
+int current_stream = 0;
+// First CPU to pin writers to, -1 = don't pin. Overridden by the -pin option
+int first_cpu = -1;
+struct timespec test_start;
+
+// Compression, set by the -c and -cw options
+int do_compress = FALSE;
+stream_codec_t codec = STREAM_CODEC_NONE;
+int codec_level = STREAM_CODEC_DEFAULT_LEVEL;
+int compress_workers = 4;
+// Each pool buffer has room after the record for its compressed image, which starts
+// wire_offset bytes in and can hold wire_capacity bytes of compressed payload. The raw
+// payload is never overwritten so the pool doesn't need refreshing from master_data.
+size_t wire_offset;
+size_t wire_capacity;
+// Compression statistics, bytes are payload bytes
+_Atomic uint64_t codec_bytes_in;
+_Atomic uint64_t codec_bytes_out;
+_Atomic uint64_t codec_cpu_ns;
 
 // If we do compression the queued buffers may become corrupted. We keep a master copy
 // so that we can use bcopy to refresh the buffers in the pool.
 stream_buffer_t *master_data;
 
+// Clock records are stamped with, set by the -clock option. Its stream_clock_t goes in the
+// flags word so receivers measure latency against the same clock.
+stream_clock_t stamp_clock = STREAM_CLOCK_REALTIME;
+clockid_t stamp_clock_id = CLOCK_REALTIME;
+
 // Thread loops keep going until keep_going = 0
 int keep_going = TRUE;
 
@@ -79,9 +147,6 @@ int sendBufSize = 0;
 // TCP no delay flag
 int noDelay = 0;
 
-// socket to send on
-int target_socket;
-
 // By default we only send one buffer. Overridden by the -n option
 int loops_per_cycle = 1;
 
@@ -93,9 +158,45 @@ int do_debug = 0;
 int do_scan = 0;
 int do_jana = 0;
 
+// How the free and out queues wait, see stream_wait_t
+stream_wait_t wait_strategy = STREAM_WAIT_SLEEP;
+
+// Most buffers the writer sends with a single writev. Overridden by the -bs option
+int max_batch = 4;
+
+// -zc sends with MSG_ZEROCOPY, -sf sends -f file data with sendfile from data_fd.
+int do_zerocopy = 0;
+int do_sendfile = 0;
+int data_fd = -1;
+off_t data_file_size = 0;
+off_t data_file_position = 0;
+
 // Default to only send 40 bytes.
 int payload_length = 10;
 
+// Replay, set by -replay. The file is mapped read only and payloads go to the socket
+// straight from the mapping, the pool buffers only carry the header and, past the end
+// of the record where it is never sent, a pointer to the payload. A recording from
+// stream_test_subscriber -r is replayed record by record, any other file in -b byte
+// chunks.
+char *replay_file = NULL;
+uint8_t *replay_map = NULL;
+size_t replay_size = 0;
+int replay_records = FALSE;
+// Passes over the file, 0 = until stopped. Overridden by the -loop option
+int replay_loops = 1;
+// 0 sends as fast as possible, otherwise records keep their recorded timestamp gaps
+// divided by this. Overridden by the -speed option
+double replay_speed = 0;
+
+// Offset of the payload pointer in a pool buffer, set when the pool is made
+size_t replay_slot = 0;
+
+// Where the payload of a replayed record is, kept in its pool buffer after the record
+static inline const uint8_t **replay_payload(stream_buffer_t *buf) {
+    return (const uint8_t **) ((uint8_t *) buf + replay_slot);
+}
+
 void print_rate(struct timespec *tv, uint32_t length) {
     // local variables
     struct timespec tvEnd, tvDiff;
@@ -110,6 +211,18 @@ void print_rate(struct timespec *tv, uint32_t length) {
     data_rates[cycle_count++] = data_rate = ((float) length * loop_rate) / 1000000000.0;
     // print rates
     printf("buffer size = %d bytes, buffer rate = %.2f Hz, data rate = %.6f GByte/s\n", length, loop_rate, data_rate);
+    if (stream_count > 1) {
+        int i;
+        double seconds = (double) tvDiff.tv_sec + ((double) tvDiff.tv_nsec / 1000000000.0);
+        for (i = 0; i < stream_count; i++) {
+            source_stream_t *st = &streams[i];
+            uint64_t records = atomic_load(&st->records_sent), bytes = atomic_load(&st->bytes_sent);
+            printf("\tstream %d ID %08X: buffer rate = %.2f Hz, data rate = %.6f GByte/s\n", i, st->source_id,
+                   (records - st->last_records) / seconds, (bytes - st->last_bytes) / (seconds * 1000000000.0));
+            st->last_records = records;
+            st->last_bytes = bytes;
+        }
+    }
 }
 
 void print_final_stats() {
@@ -128,13 +241,32 @@ void print_final_stats() {
     sd /= cycle_count;
     sd = sqrt(sd);
     printf("%.2f Hz, %.6f +/- %.2f GByte/s \n", block_rate, data_rate, sd);
+    if (stream_count > 1) {
+        struct timespec tNow, tDiff;
+        clock_gettime(CLOCK_REALTIME, &tNow);
+        time_subtract(&tDiff, &tNow, &test_start);
+        double seconds = (double) tDiff.tv_sec + ((double) tDiff.tv_nsec / 1000000000.0);
+        for (i = 0; i < stream_count; i++) {
+            source_stream_t *st = &streams[i];
+            uint64_t records = atomic_load(&st->records_sent), bytes = atomic_load(&st->bytes_sent);
+            printf("\tstream %d ID %08X: %lu buffers, %.2f Hz, %.6f GByte/s\n", i, st->source_id,
+                   (unsigned long) records, records / seconds, bytes / (seconds * 1000000000.0));
+        }
+    }
+    if (do_compress) {
+        double in = atomic_load(&codec_bytes_in), out = atomic_load(&codec_bytes_out);
+        double cpu = atomic_load(&codec_cpu_ns) / 1000000000.0;
+        printf("Compression %s level %d: ratio %.3f, %.1f MByte in, %.1f MByte out, %.2f s CPU, %.1f MByte/s per core\n",
+               stream_codec_name(codec), codec_level, out > 0 ? in / out : 0.0, in / 1000000.0, out / 1000000.0,
+               cpu, cpu > 0 ? in / (cpu * 1000000.0) : 0.0);
+    }
 }
 
 // Give the poor user some help on command line options.
 void print_options(char *pname) {
-    printf("usage: %s [-vc] [-h host] [-f file] [-p port] [-n buffers] [-l loops] [-b bytes] [-r rate] [-j jana] [-tb bytes] [-nd]\n", pname);
+    printf("usage: %s [-vc] [-h host] [-f file] [-p port] [-n buffers] [-l loops] [-b bytes] [-r rate] [-j jana] [-w wait] [-tb bytes] [-nd] [-bs buffers] [-zc] [-sf] [-ns streams] [-pin cpu] [-cw workers] [-clock clock]\n", pname);
     printf("\t-v: verbose\n");
-    printf("\t-c: compress data before send\n");
+    printf("\t-c <codec[:level]>: compress data before send, none, lz4, zstd or snappy\n");
     printf("\t-h <host>: specify a host [default: \"localhost\"]\n");
     printf("\t-f <file>: read source data from a file [default: random data]\n");
     printf("\t-p <port>: specify a port [default: 5555]\n");
@@ -144,49 +276,267 @@ void print_options(char *pname) {
     printf("\t-r <rate>: rate in kbyte/s\n");
     printf("\t-s: scan mode - divide b by \n");
     printf("\t-j: jana mode \n");
+    printf("\t-w <wait>: queue wait strategy sleep|spin|yield|block [default: sleep]\n");
     printf("\t-tb <bytes>: TCP buffer size \n");
     printf("\t-nd: TCP set noDelay on \n");
+    printf("\t-bs <buffers>: most buffers sent per writev [default: 4]\n");
+    printf("\t-zc: send with MSG_ZEROCOPY\n");
+    printf("\t-sf: with -f send the file data with sendfile\n");
+    printf("\t-ns <streams>: number of parallel connections, IDs count up from -i [default: 1]\n");
+    printf("\t-pin <cpu>: pin the writer of stream k to CPU cpu + k\n");
+    printf("\t-cw <workers>: compression threads per stream [default: 4]\n");
+    printf("\t-replay <file>: send a recording, or -b byte chunks of any other file, from a mapping of it\n");
+    printf("\t-loop <n>: with -replay pass over the file n times, 0 = until stopped [default: 1]\n");
+    printf("\t-speed <factor>: with -replay keep the recorded timestamp gaps divided by factor [default: as fast as possible]\n");
+    printf("\t-clock <clock>: stamp records with the realtime, tai or monotonic clock [default: realtime]\n");
 }
 
 typedef struct compression_stream {
     stream_rb_t *in_queue;
     stream_rb_t *out_queue;
+    pthread_t thread;
 } compression_stream_t;
 
-/*void *compression_thread(void *arg) {
-	compression_stream_t *cs = (compression_stream_t *) arg;
-	while (keep_going) {
-		uint8_t *in_data = (uint8_t *) stream_queue_get(cs->in_queue);
-		uint8_t *buffer_out;
-		uint32_t payload_length = stream_to_int(in_data);
-		// We reserve 3 x 32-bit words to hold lengths - see later...
-		if ((buffer_out = (uint8_t *) malloc(
-				snappy_max_compressed_length(payload_length + 12) + 12)) == NULL) {
-			printf("cannot allocate buffer of %d bytes\n",
-					(int) snappy_max_compressed_length(payload_length + 12)
-							+ 12);
-			exit(1);
-		}
-		size_t out_length = snappy_max_compressed_length(payload_length);
-		int res = snappy_compress(&env, (char *) &in_data[8],
-				payload_length - 8, (char *) &buffer_out[8], &out_length);
-		// Fill in the two length words..
-		// 1) Current total length of the buffer
-		// 2) Payload uncompressed length
-		// 3) Payload compressed length.
-		//printf("Snappy, before %p %d after %p %d\n", buffer, payload_length, buffer_out, out_length);
-		if (res != 0) {
-			printf("Snappy not Happy %d, to before %d after %d\n", res,
-					payload_length, (int) out_length);
-			exit(-res);
-		}
-	}
-	return 0;
-}*/
+// Compress the payload of buf into its wire image. If that doesn't make it smaller
+// the record goes out as it is.
+void compress_record(stream_buffer_t *buf) {
+    stream_buffer_t *wire = (stream_buffer_t *) ((uint8_t *) buf + wire_offset);
+    size_t n = stream_codec_compress(codec, codec_level, buf->payload, buf->payload_length,
+                                     wire->payload, wire_capacity);
+    atomic_fetch_add_explicit(&codec_bytes_in, buf->payload_length, memory_order_relaxed);
+    if (n == 0 || n >= buf->payload_length) {
+        buf->compressed_length = buf->payload_length;
+        atomic_fetch_add_explicit(&codec_bytes_out, buf->payload_length, memory_order_relaxed);
+        return;
+    }
+    atomic_fetch_add_explicit(&codec_bytes_out, n, memory_order_relaxed);
+    memcpy(wire, buf, sizeof(stream_buffer_t));
+    // Zero the padding so the record is the same every time it is sent
+    memset((uint8_t *) wire->payload + n, 0, ((n + 3) & ~3) - n);
+    wire->compressed_length = n;
+    wire->total_length = sizeof(stream_buffer_t) + ((n + 3) & ~3);
+    wire->flags = (buf->flags & ~STREAM_FLAG_CODEC_MASK) | (codec << STREAM_FLAG_CODEC_SHIFT);
+    buf->compressed_length = n;
+}
+
+// The bytes that go on the wire for buf, the compressed image if there is one.
+static inline stream_buffer_t *wire_image(stream_buffer_t *buf) {
+    if (do_compress && buf->compressed_length < buf->payload_length)
+        return (stream_buffer_t *) ((uint8_t *) buf + wire_offset);
+    return buf;
+}
+
+void *compression_thread(void *arg) {
+    compression_stream_t *cs = (compression_stream_t *) arg;
+    struct timespec cpu;
+    for (;;) {
+        stream_buffer_t *buf = stream_queue_get(cs->in_queue);
+        if (buf == NULL)
+            continue;
+        if (buf != (stream_buffer_t *) - 1)
+            compress_record(buf);
+        stream_queue_add(cs->out_queue, buf);
+        // Pass the end marker on to the writer and stop
+        if (buf == (stream_buffer_t *) - 1)
+            break;
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    atomic_fetch_add(&codec_cpu_ns, (uint64_t) cpu.tv_sec * 1000000000 + cpu.tv_nsec);
+    return 0;
+}
+
+// Hand a buffer to a stream, through the next compression worker if compressing.
+void submit_buffer(source_stream_t *st, stream_buffer_t *buf) {
+    if (!do_compress) {
+        stream_queue_add(st->out_queue, buf);
+        return;
+    }
+    stream_queue_add(st->compressors[st->next_compressor].in_queue, buf);
+    st->next_compressor = (st->next_compressor + 1) % compress_workers;
+}
+
+// Up to max buffers for the writer of a stream, in record order. Compressed records are
+// collected from the workers in the same round robin order submit_buffer used.
+int next_buffers(source_stream_t *st, stream_buffer_t **bufs, int max, int wait) {
+    int count = 0;
+    if (!do_compress) {
+        if (wait)
+            return stream_queue_get_batch(st->out_queue, (void **) bufs, max);
+        return stream_queue_try_get_batch(st->out_queue, (void **) bufs, max);
+    }
+    while (count < max) {
+        stream_rb_t *q = st->compressors[st->next_collect].out_queue;
+        stream_buffer_t *buf = (count == 0 && wait) ? stream_queue_get(q) : stream_queue_try_get(q);
+        if (buf == NULL)
+            break;
+        bufs[count++] = buf;
+        st->next_collect = (st->next_collect + 1) % compress_workers;
+        if (buf == (stream_buffer_t *) - 1)
+            break;
+    }
+    return count;
+}
+
+// MSG_ZEROCOPY bookkeeping. The kernel numbers every sendmsg call that sends data and later
+// reports ranges of those numbers on the socket error queue once it no longer needs the
+// pages. Each batch records which numbers it used and its buffers only go back to
+// the free queue of the stream when all of them have been reported.
+typedef struct zc_batch {
+    uint32_t first;
+    uint32_t calls;
+    uint32_t remaining;
+    int count;
+    stream_buffer_t **bufs;
+} zc_batch_t;
+
+typedef struct zc_state {
+    stream_rb_t *free_queue;
+    uint32_t next_seq;
+    zc_batch_t *batches;
+    int size;
+    int head;
+    int pending;
+    // Statistics
+    uint64_t calls;
+    uint64_t copied;
+} zc_state_t;
+
+zc_state_t *zc_create(stream_rb_t *free_queue) {
+    int i, size = free_queue->size;
+    zc_state_t *zc = calloc(1, sizeof(zc_state_t));
+    zc->free_queue = free_queue;
+    zc->size = size;
+    zc->batches = calloc(size, sizeof(zc_batch_t));
+    for (i = 0; i < size; i++)
+        zc->batches[i].bufs = calloc(max_batch, sizeof(stream_buffer_t *));
+    return zc;
+}
+
+// Read completion notifications, waiting up to timeout ms for the first if timeout > 0, and
+// return the buffers of every batch at the head of the list that is finished with.
+void zc_reap(zc_state_t *zc, int fd, int timeout) {
+    if (timeout > 0) {
+        struct pollfd pfd = {fd, 0, 0};
+        poll(&pfd, 1, timeout);
+    }
+    for (;;) {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err *err = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            uint32_t lo = err->ee_info, hi = err->ee_data;
+            // The kernel fell back to copying, e.g. on loopback
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied += hi - lo + 1;
+            int i;
+            for (i = 0; i < zc->pending; i++) {
+                zc_batch_t *b = &zc->batches[(zc->head + i) % zc->size];
+                // Overlap of [lo, hi] with this batch's numbers, in wrap-safe arithmetic
+                uint32_t from = (int32_t) (lo - b->first) > 0 ? lo : b->first;
+                uint32_t last = b->first + b->calls - 1;
+                uint32_t to = (int32_t) (hi - last) < 0 ? hi : last;
+                if ((int32_t) (to - from) >= 0)
+                    b->remaining -= to - from + 1;
+            }
+        }
+    }
+    while (zc->pending > 0 && zc->batches[zc->head].remaining == 0) {
+        zc_batch_t *b = &zc->batches[zc->head];
+        stream_queue_add_batch(zc->free_queue, (void **) b->bufs, b->count);
+        zc->head = (zc->head + 1) % zc->size;
+        zc->pending--;
+    }
+}
+
+// Send every byte described by iov, carrying on after partial writes. With zc != NULL the
+// data is sent with MSG_ZEROCOPY. Returns the number of sendmsg calls that sent data,
+// or -1 on error.
+int send_all(int fd, struct iovec *iov, int count, zc_state_t *zc) {
+    int calls = 0;
+    while (count > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count > IOV_MAX ? IOV_MAX : count;
+        ssize_t n = sendmsg(fd, &msg, zc != NULL ? MSG_ZEROCOPY : 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // Too many pages pinned for zero copy, wait for the kernel to release some.
+            if (errno == ENOBUFS && zc != NULL) {
+                zc_reap(zc, fd, 1);
+                continue;
+            }
+            return -1;
+        }
+        calls++;
+        if (do_debug > 1)
+            printf("sent %d bytes\n", (int) n);
+        // Skip the buffers that went out completely and trim the one that went out in part.
+        while (count > 0 && n >= (ssize_t) iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return calls;
+}
+
+// Send one record in sendfile mode. The header is in buf but the payload is sent straight
+// from the data file, which the records cover in order starting from the beginning.
+int send_from_file(int fd, stream_buffer_t *buf, off_t *position) {
+    struct iovec iov;
+    int header = sizeof(stream_buffer_t);
+    int padding = buf->total_length - header - buf->payload_length;
+    iov.iov_base = buf;
+    iov.iov_len = header;
+    if (send_all(fd, &iov, 1, NULL) < 0)
+        return -1;
+    size_t left = buf->payload_length;
+    while (left > 0) {
+        ssize_t n = sendfile(fd, data_fd, position, left);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        left -= n;
+    }
+    // The record length is padded to 4 bytes, pad from whatever is in the buffer.
+    if (padding > 0) {
+        iov.iov_base = (uint8_t *) buf->payload;
+        iov.iov_len = padding;
+        if (send_all(fd, &iov, 1, NULL) < 0)
+            return -1;
+    }
+    return 0;
+}
 
 void *writer_thread(void *arg) {
-    stream_rb_t *in = (stream_rb_t *) arg;
+    source_stream_t *st = (source_stream_t *) arg;
+    int target_socket = st->socket;
     uint32_t magic = CODA_MAGIC;
+    stream_buffer_t *bufs[max_batch];
+    // A replayed record is two pieces, its header and the payload in the mapping
+    struct iovec iov[2 * max_batch];
+    int done = FALSE;
+    off_t file_position = 0;
+    zc_state_t *zc = NULL;
     /* The first thing down a newly opened socket is the magic number
      * The second thing down a newly opened socket is the unique ID of the sender.
      */
@@ -195,65 +545,360 @@ void *writer_thread(void *arg) {
         perror("write error or wrote less than 4 bytes: ");
         return NULL;
     }
-    n = write(target_socket, &source_id, 4);
+    if (st->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(st->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            printf("Stream %d could not be pinned to CPU %d\n", st->index, st->cpu);
+    }
+    n = write(target_socket, &st->source_id, 4);
     if (n != 4) {
         perror("write error or wrote less than 4 bytes: ");
         return NULL;
     }
+    if (do_zerocopy)
+        zc = zc_create(st->free_queue);
     // If both writes succeed then we assume all is well and start sending data.
-    while (keep_going) {
-        stream_buffer_t *buf = stream_queue_get(in);
-        if (buf == (stream_buffer_t *) - 1) break;
-        // Total record length is always padded to 4 byte boundary
-        int out_length = buf->total_length; // this is in bytes
-        if (do_debug > 0) {
-            printf("Writer for has data\n");
-            print_data_hex((uint8_t *) buf, out_length);
+    while (keep_going && !done) {
+        // Take everything that is queued, up to max_batch buffers, and send it with one writev.
+        // Zero copy can't block on the queue while it holds buffers, the main thread may be
+        // waiting for them, so it polls for completions instead.
+        int i, count, pieces = 0;
+        if (zc != NULL && zc->pending > 0) {
+            zc_reap(zc, target_socket, 0);
+            count = next_buffers(st, bufs, max_batch, FALSE);
+            if (count == 0) {
+                zc_reap(zc, target_socket, 1);
+                continue;
+            }
         }
-        int data_sent = 0;
-        int try_send = out_length;
-        while (data_sent < out_length) {
-            if (do_debug > 1)
-                printf("send remaining %d bytes of %d", try_send, out_length);
-            int nSent = write(target_socket, buf + data_sent, try_send);
-            if (nSent < 0) {
-                perror("write error during data write: ");
-                //print_data_hex((uint8_t *) buf, out_length);
+        else
+            count = next_buffers(st, bufs, max_batch, TRUE);
+        for (i = 0; i < count; i++) {
+            if (bufs[i] == (stream_buffer_t *) - 1) {
+                done = TRUE;
+                count = i;
                 break;
             }
-            if (nSent != try_send) {
-                printf("Sent %d bytes out of %d\n", nSent, try_send);
-            } 
+            // Total record length is always padded to 4 byte boundary
+            stream_buffer_t *wire = wire_image(bufs[i]);
+            iov[pieces].iov_base = wire;
+            if (replay_map != NULL) {
+                iov[pieces++].iov_len = sizeof(stream_buffer_t);
+                iov[pieces].iov_base = (void *) *replay_payload(wire);
+                iov[pieces++].iov_len = wire->total_length - sizeof(stream_buffer_t);
+            }
             else
-                break;
-            data_sent += nSent;
-            try_send -= nSent;
+                iov[pieces++].iov_len = wire->total_length; // this is in bytes
+            if (do_debug > 0) {
+                printf("Writer for has data\n");
+                print_data_hex((uint8_t *) wire, replay_map != NULL ? sizeof(stream_buffer_t) : wire->total_length);
+            }
+        }
+        if (count == 0)
+            continue;
+        for (i = 0; i < pieces; i++)
+            atomic_fetch_add_explicit(&st->bytes_sent, iov[i].iov_len, memory_order_relaxed);
+        atomic_fetch_add_explicit(&st->records_sent, count, memory_order_relaxed);
+        if (do_sendfile) {
+            for (i = 0; i < count; i++)
+                if (send_from_file(target_socket, bufs[i], &file_position) < 0) {
+                    perror("sendfile error during data write: ");
+                    done = TRUE;
+                    break;
+                }
+        }
+        else {
+            int calls = send_all(target_socket, iov, pieces, zc);
+            if (calls < 0) {
+                perror("write error during data write: ");
+                done = TRUE;
+            }
+            else if (zc != NULL) {
+                // Hold on to the buffers until the kernel says it is done with them.
+                zc_batch_t *b = &zc->batches[(zc->head + zc->pending) % zc->size];
+                b->first = zc->next_seq;
+                b->calls = b->remaining = calls;
+                b->count = count;
+                memcpy(b->bufs, bufs, count * sizeof(stream_buffer_t *));
+                zc->next_seq += calls;
+                zc->calls += calls;
+                zc->pending++;
+                continue;
+            }
         }
-        stream_queue_add(free_buffer_queue, buf);
+        stream_queue_add_batch(st->free_queue, (void **) bufs, count);
+    }
+    if (zc != NULL) {
+        // Let outstanding sends complete so every buffer is accounted for.
+        int tries = 1000;
+        while (zc->pending > 0 && tries-- > 0)
+            zc_reap(zc, target_socket, 1);
+        printf("Zero copy: %lu sends, %lu copied by the kernel\n",
+               (unsigned long) zc->calls, (unsigned long) zc->copied);
     }
-    printf("Sending thread exits...\n");
+    if (stream_count > 1)
+        printf("Sending thread for stream %d exits...\n", st->index);
+    else
+        printf("Sending thread exits...\n");
     return 0;
 }
 
+// Free buffer for the next record, from the stream whose turn it is.
+stream_buffer_t *take_buffer(void) {
+    source_stream_t *st = &streams[current_stream];
+    stream_buffer_t *buf = stream_queue_get(st->free_queue);
+    buf->record_counter = st->next_record++;
+    return buf;
+}
+
+// Send a buffer from take_buffer on its stream and move on to the next stream.
+void queue_buffer(stream_buffer_t *buf) {
+    buf->flags = (buf->flags & ~STREAM_FLAG_CLOCK_MASK) | (stamp_clock << STREAM_FLAG_CLOCK_SHIFT);
+    submit_buffer(&streams[current_stream], buf);
+    current_stream = (current_stream + 1) % stream_count;
+}
+
+// Open a socket, tune it for performance and connect it to the target.
+int connect_stream(void) {
+    struct sockaddr_in internet_address;
+    // Grab a socket and tune it for performance.
+    int target_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (target_socket < 0) {
+        printf("cannot open socket\n");
+        exit(2);
+    }
+    
+    // Size of socket's buffers
+    if (sendBufSize != 0) {
+        printf("Set TCP send buf size to %d bytes\n", sendBufSize);
+        // Set the socket buffer size
+        if (setsockopt(target_socket, SOL_SOCKET, SO_SNDBUF, &sendBufSize, sizeof(sendBufSize)) < 0) {
+            printf("setsockopt SO_SNDBUF failed\n");
+            exit(1);
+        }
+    }
+    
+    int sBufSize;
+    socklen_t len = sizeof(sBufSize);
+    if (getsockopt(target_socket, SOL_SOCKET, SO_SNDBUF, &sBufSize, &len) < 0) {
+        printf("ERROR retrieving actual TCP send buf size\n");
+    }
+    else {
+        printf("Actual TCP send buf size = %d bytes\n", sBufSize);
+    }
+
+    // Set TCP nodelay
+    if (noDelay) {
+        if (setsockopt(target_socket, IPPROTO_TCP, TCP_NODELAY, (char*) &noDelay, sizeof(noDelay)) < 0) {
+            printf("setsockopt TCP_NODELAY failed\n");
+            exit(1);
+        }
+        printf("Set TCP send socket to no delay\n");
+    }
+
+    // Allow MSG_ZEROCOPY sends
+    if (do_zerocopy) {
+        int one = 1;
+        if (setsockopt(target_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            printf("setsockopt SO_ZEROCOPY failed, sending with copies\n");
+            do_zerocopy = 0;
+        }
+        else printf("Sending with MSG_ZEROCOPY\n");
+    }
+       
+    // hostdb entry for this target if hostname is given
+    struct hostent *host_entry; 
+    // Call gethostbyname() to convert string into host_entry from hostdb.
+    host_entry = gethostbyname(target_host);
+    // Set up the socket that we will use for sending.
+    // This is an important step. We fill in parts of the address
+    // parts that we do not touch must be empty.
+    bzero((char *) &internet_address, sizeof(internet_address));
+    // If host_entry is null then target_host was probably an IP address in dot notation.
+    if (host_entry == NULL) {
+        internet_address.sin_addr.s_addr = inet_addr(target_host);
+        if (internet_address.sin_addr.s_addr == -1) {
+            fprintf(stderr, "%s: unknown host\n", target_host);
+            exit(2);
+        }
+    } 
+    else {
+        // Found argv[1] in hostdb!
+        // Print the name from  host_entry
+        printf(">>> hostname >%s<\n", host_entry->h_name);
+        // copy the address
+        bcopy(host_entry->h_addr, &internet_address.sin_addr, host_entry->h_length);
+    }
+    // put in the port
+    internet_address.sin_port = htons(target_port);
+    internet_address.sin_family = AF_INET;
+    // Finally, attempt to connect our socket to the target host and port.
+    if (connect(target_socket, (const struct sockaddr *) &internet_address, sizeof(internet_address)) < 0) {
+        perror("connect");
+        printf("connect failed: host %s port %d\n",
+                inet_ntoa(internet_address.sin_addr), ntohs(internet_address.sin_port));
+        exit(1);
+    }
+    return target_socket;
+}
+
+// Fill the payload of buf with the next length bytes of the data file. With -sf the data is
+// not read, the writer sends it straight from the file, so only the length is worked out.
+int read_chunk(int fd, stream_buffer_t *buf, int length) {
+    if (!do_sendfile)
+        return read(fd, buf->payload, length);
+    off_t left = data_file_size - data_file_position;
+    int n = left < length ? (int) left : length;
+    data_file_position += n;
+    return n;
+}
+
+// Map the replay file and work out whether it is a recording, every record starts with
+// a header carrying the magic number.
+void replay_open(void) {
+    struct stat st;
+    int fd = open(replay_file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+        printf("Error opening file %s\n", replay_file);
+        exit(-1);
+    }
+    replay_size = st.st_size;
+    replay_map = mmap(NULL, replay_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (replay_map == MAP_FAILED) {
+        perror("mmap");
+        exit(-1);
+    }
+    close(fd);
+    // Read ahead hard and, where the file system can, back the mapping with huge pages
+    madvise(replay_map, replay_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(replay_map, replay_size, MADV_HUGEPAGE);
+#endif
+    stream_buffer_t *first = (stream_buffer_t *) replay_map;
+    replay_records = replay_size >= sizeof(stream_buffer_t) && first->magic == CODA_MAGIC &&
+                     first->total_length >= sizeof(stream_buffer_t);
+    printf("Replaying %s, %lu bytes %s\n", replay_file, (unsigned long) replay_size,
+           replay_records ? "of recorded records" : "in chunks");
+}
+
+// Bytes taken by the record at offset in a recording, 0 if there is no whole record there.
+// Records follow each other on 4 byte boundaries in a recording and in a router spill
+// segment, the walk ends at a record cut short at the end of the file or at the zero
+// tail of a spill segment.
+static size_t replay_record_length(size_t offset) {
+    if (offset >= replay_size || replay_size - offset < sizeof(stream_buffer_t))
+        return 0;
+    stream_buffer_t *rec = (stream_buffer_t *) (replay_map + offset);
+    size_t length = (rec->total_length + 3) & ~(size_t) 3;
+    if (rec->total_length < sizeof(stream_buffer_t) || length > replay_size - offset)
+        return 0;
+    return length;
+}
+
+// Send the replay file pass after pass. Headers are filled in from the recording, or made
+// up for chunks, and get this stream's source ID, record counter and the time now.
+void replay(struct timespec *delay, struct timespec *tvStartBlock) {
+    int pass;
+    uint64_t sent = 0, block_bytes = 0;
+    size_t chunk = payload_length * 4;
+    for (pass = 0; replay_loops == 0 || pass < replay_loops; pass++) {
+        size_t offset = 0;
+        struct timespec base, first_ts;
+        clock_gettime(CLOCK_MONOTONIC, &base);
+        first_ts = ((stream_buffer_t *) replay_map)->timestamp;
+        while (offset < replay_size) {
+            stream_buffer_t *rec = (stream_buffer_t *) (replay_map + offset);
+            stream_buffer_t *buf;
+            // Set on the last record of a pass, however the walk ends
+            int end;
+            if (replay_records) {
+                size_t length = replay_record_length(offset);
+                if (length == 0)
+                    break;
+                if (replay_speed > 0) {
+                    struct timespec gap, when;
+                    time_subtract(&gap, &rec->timestamp, &first_ts);
+                    int64_t ns = (int64_t) ((gap.tv_sec * 1000000000.0 + gap.tv_nsec) / replay_speed);
+                    when.tv_sec = base.tv_sec + (base.tv_nsec + ns) / 1000000000;
+                    when.tv_nsec = (base.tv_nsec + ns) % 1000000000;
+                    if (ns > 0)
+                        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL);
+                }
+                buf = take_buffer();
+                buf->total_length = rec->total_length;
+                buf->payload_length = rec->payload_length;
+                buf->compressed_length = rec->compressed_length;
+                buf->magic = rec->magic;
+                buf->format_version = rec->format_version;
+                buf->flags = rec->flags & ~STREAM_FLAG_LAST;
+                *replay_payload(buf) = (const uint8_t *) rec->payload;
+                offset += length;
+                end = replay_record_length(offset) == 0;
+            }
+            else {
+                size_t n = replay_size - offset < chunk ? replay_size - offset : chunk;
+                buf = take_buffer();
+                buf->total_length = sizeof(stream_buffer_t) + ((n + 3) & ~3);
+                buf->payload_length = buf->compressed_length = n;
+                buf->flags = 0;
+                *replay_payload(buf) = replay_map + offset;
+                offset += n;
+                end = offset >= replay_size;
+            }
+            if (pass == replay_loops - 1 && end)
+                buf->flags |= STREAM_FLAG_LAST;
+            clock_gettime(stamp_clock_id, &buf->timestamp);
+            block_bytes += buf->total_length;
+            queue_buffer(buf);
+            // Records vary in size, report the rate with their average length
+            if (++sent % loops_per_cycle == 0) {
+                printf("\nbuffer counter = %lu, ", (unsigned long) sent);
+                print_rate(tvStartBlock, block_bytes / loops_per_cycle);
+                block_bytes = 0;
+                clock_gettime(CLOCK_REALTIME, tvStartBlock);
+            }
+            if (delay->tv_nsec > 0)
+                nanosleep(delay, NULL);
+        }
+    }
+    // Rate for the records since the last report, print_rate counts loops_per_cycle of them
+    if (sent % loops_per_cycle != 0) {
+        loops_per_cycle = sent % loops_per_cycle;
+        print_rate(tvStartBlock, block_bytes / loops_per_cycle);
+    }
+    printf("\nReplayed %lu records from %s in %d passes\n", (unsigned long) sent, replay_file, pass);
+}
+
 int main(int argc, char *argv[]) {
     // Define local variables
-    struct sockaddr_in internet_address;
+    int ix;
     struct timespec delay;
     delay.tv_nsec = delay.tv_sec = 0;
     char *data_file = NULL;
-    //int do_compress = TRUE;
     // Get the command line arguments
     
     /* 4 multiple character command-line options */
     static struct option long_options[] = {
         {"tb", 1, NULL, 0},
         {"nd", 0, NULL, 1},
+        {"bs", 1, NULL, 2},
+        {"zc", 0, NULL, 3},
+        {"sf", 0, NULL, 4},
+        {"ns", 1, NULL, 5},
+        {"pin", 1, NULL, 6},
+        {"cw", 1, NULL, 7},
+        {"replay", 1, NULL, 8},
+        {"loop", 1, NULL, 9},
+        {"speed", 1, NULL, 10},
+        {"clock", 1, NULL, 11},
         {0, 0, 0, 0}
     };
 
     char opt;
 //    while ((opt = getopt(argc, argv, "jsvcf:r:i:h:o:p:n:b:l:")) != -1) {
-    while ((opt = getopt_long_only(argc, argv, "jsvcf:r:i:h:o:p:n:b:l:", long_options, 0)) != -1) {
+    while ((opt = getopt_long_only(argc, argv, "jsvc:f:r:i:h:o:p:n:b:l:w:", long_options, 0)) != -1) {
         switch (opt) {
             case 'j':
                 // Turn on jana mode
@@ -275,8 +920,12 @@ int main(int argc, char *argv[]) {
                 break;
             case 'c':
                 // Turn on compression
-                //do_compress = 1;
-                printf("Compression turned on - but not implemented\n");
+                if (stream_codec_parse(optarg, &codec, &codec_level) < 0) {
+                    printf("unknown or unsupported codec %s\n", optarg);
+                    exit(0);
+                }
+                do_compress = 1;
+                printf("Compression turned on, codec %s\n", stream_codec_name(codec));
                 break;
             case 'h':
                 // Set the host for this source to send to
@@ -348,6 +997,16 @@ int main(int argc, char *argv[]) {
                 printf("send at %d kbytes per second, %d Hz\n", rate, brate);
                 break;
             }
+            case 'w': {
+                int w = stream_wait_from_name(optarg);
+                if (w < 0) {
+                    printf("invalid wait strategy = %s\n", optarg);
+                    exit(0);
+                }
+                wait_strategy = w;
+                printf("Queue wait strategy %s\n", optarg);
+                break;
+            }
             case 0:
                 sendBufSize = atoi(optarg);
                 if (sendBufSize < 1) {
@@ -358,92 +1017,105 @@ int main(int argc, char *argv[]) {
             case 1:
                 noDelay = 1;
                 break;
+            case 2:
+                max_batch = atoi(optarg);
+                if (max_batch < 1) {
+                    printf("invalid batch size = %s, must be > 0.\n", optarg);
+                    exit(0);
+                }
+                printf("Send up to %d buffers per write\n", max_batch);
+                break;
+            case 3:
+                do_zerocopy = 1;
+                break;
+            case 4:
+                do_sendfile = 1;
+                break;
+            case 5:
+                stream_count = atoi(optarg);
+                if (stream_count < 1) {
+                    printf("invalid number of streams = %s, must be > 0.\n", optarg);
+                    exit(0);
+                }
+                printf("Sending on %d parallel streams\n", stream_count);
+                break;
+            case 7:
+                compress_workers = atoi(optarg);
+                if (compress_workers < 1) {
+                    printf("invalid number of compression workers = %s, must be > 0.\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 6:
+                first_cpu = atoi(optarg);
+                if (first_cpu < 0) {
+                    printf("invalid CPU = %s, must be >= 0.\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 8:
+                replay_file = strdup(optarg);
+                break;
+            case 9:
+                replay_loops = atoi(optarg);
+                if (replay_loops < 0) {
+                    printf("invalid number of passes = %s, must be >= 0.\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 10:
+                replay_speed = atof(optarg);
+                if (replay_speed <= 0) {
+                    printf("invalid replay speed = %s, must be > 0.\n", optarg);
+                    exit(0);
+                }
+                break;
+            case 11: {
+                int c = stream_clock_from_name(optarg);
+                if (c < 0) {
+                    printf("invalid clock = %s, must be realtime, tai or monotonic.\n", optarg);
+                    exit(0);
+                }
+                stamp_clock = c;
+                stamp_clock_id = stream_clock_id(stamp_clock);
+                printf("Stamping records with the %s clock\n", optarg);
+                break;
+            }
             default:
                 print_options(argv[0]);
                 return (0);
         }
     }
-    // Grab a socket and tune it for performance.
-    target_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (target_socket < 0) {
-        printf("cannot open socket\n");
-        exit(2);
-    }
-    
-    // Size of socket's buffers
-    if (sendBufSize != 0) {
-        printf("Set TCP send buf size to %d bytes\n", sendBufSize);
-        // Set the socket buffer size
-        if (setsockopt(target_socket, SOL_SOCKET, SO_SNDBUF, &sendBufSize, sizeof(sendBufSize)) < 0) {
-            printf("setsockopt SO_SNDBUF failed\n");
-            exit(1);
+    if (replay_file != NULL) {
+        if (data_file != NULL || do_jana) {
+            printf("-replay can't be used with -f or -j\n");
+            exit(0);
         }
+        // Records go out exactly as they were recorded
+        if (do_compress)
+            printf("Replayed records are sent as they are, not compressing\n");
+        do_compress = 0;
+        do_sendfile = 0;
+        replay_open();
     }
-    
-    int sBufSize;
-    socklen_t len = sizeof(sBufSize);
-    if (getsockopt(target_socket, SOL_SOCKET, SO_SNDBUF, &sBufSize, &len) < 0) {
-        printf("ERROR retrieving actual TCP send buf size\n");
-    }
-    else {
-        printf("Actual TCP send buf size = %d bytes\n", sBufSize);
-    }
-
-    // Set TCP nodelay
-    if (noDelay) {
-        if (setsockopt(target_socket, IPPROTO_TCP, TCP_NODELAY, (char*) &noDelay, sizeof(noDelay)) < 0) {
-            printf("setsockopt TCP_NODELAY failed\n");
-            exit(1);
-        }
-        printf("Set TCP send socket to no delay\n");
-    }
-       
-    /*optval = 1;
-     if (setsockopt(target_socket, IPPROTO_TCP, TCP_NODELAY, &optval,
-     sizeof(optval)) < 0) {
-     printf("setsockopt TCP_NODELAY failed\n");
-     free(buffer);
-     exit(1);
-     }*/
-    // hostdb entry for this target if hostname is given
-    struct hostent *host_entry; 
-    // Call gethostbyname() to convert string into host_entry from hostdb.
-    host_entry = gethostbyname(target_host);
-    // Set up the socket that we will use for sending.
-    // This is an important step. We fill in parts of the address
-    // parts that we do not touch must be empty.
-    bzero((char *) &internet_address, sizeof(internet_address));
-    // If host_entry is null then target_host was probably an IP address in dot notation.
-    if (host_entry == NULL) {
-        internet_address.sin_addr.s_addr = inet_addr(target_host);
-        if (internet_address.sin_addr.s_addr == -1) {
-            fprintf(stderr, "%s: unknown host\n", target_host);
-            exit(2);
-        }
-    } 
-    else {
-        // Found argv[1] in hostdb!
-        // Print the name from  host_entry
-        printf(">>> hostname >%s<\n", host_entry->h_name);
-        // copy the address
-        bcopy(host_entry->h_addr, &internet_address.sin_addr, host_entry->h_length);
+    if (do_sendfile && stream_count > 1) {
+        printf("sendfile needs a single stream, reading the file instead\n");
+        do_sendfile = 0;
     }
-    // put in the port
-    internet_address.sin_port = htons(target_port);
-    internet_address.sin_family = AF_INET;
-    // Finally, attempt to connect our socket to the target host and port.
-    if (connect(target_socket, (const struct sockaddr *) &internet_address, sizeof(internet_address)) < 0) {
-        perror("connect");
-        printf("connect failed: host %s port %d\n",
-                inet_ntoa(internet_address.sin_addr), ntohs(internet_address.sin_port));
-        exit(1);
+    streams = calloc(stream_count, sizeof(source_stream_t));
+    for (ix = 0; ix < stream_count; ix++) {
+        streams[ix].index = ix;
+        streams[ix].source_id = source_id + ix;
+        streams[ix].cpu = first_cpu < 0 ? -1 : (first_cpu + ix) % (int) sysconf(_SC_NPROCESSORS_ONLN);
+        streams[ix].socket = connect_stream();
     }
     printf("connected and preparing to send...\n");
     // Done setting up socket
     // Set up queues.
-    printf("Creating buffer pool with %d buffers\n", 4);
-    // We are going to have a pool of four pre-filled buffers created by copying one master.
-    free_buffer_queue = stream_queue_create(4);
+    // We are going to have a pool of pre-filled buffers created by copying one master. There
+    // are at least four and enough for the writer to send a full batch while the next fills.
+    int pool_size = max_batch * 2 > 4 ? max_batch * 2 : 4;
+    printf("Creating buffer pool with %d buffers per stream\n", pool_size);
     // Allocate a stream_buffer to hold a master copy of the data.
     int request_length = (payload_length * 4) + sizeof(stream_buffer_t);
     // ensure that request length is divisible by 4 bytes
@@ -462,7 +1134,7 @@ int main(int argc, char *argv[]) {
     master_data->magic = CODA_MAGIC;
     // We can fill the master copy from a file if one is specified, otherwise random numbers.
     // Was a data file specified on command line?
-    int ix, of, cf;
+    int of = -1, cf;
     if (data_file == NULL) {
         printf("Filling data source buffer with random numbers\n");
         // No, so fill buffer with random words
@@ -474,42 +1146,74 @@ int main(int argc, char *argv[]) {
         printf("Filling buffer payloads with %d bytes from file %s\n",
                 (int) master_data->payload_length, data_file);
         of = open(data_file, O_RDONLY);
-        if (!of) {printf("Error opening file %s\n", data_file); exit(-1);}
+        if (of < 0) {printf("Error opening file %s\n", data_file); exit(-1);}
+        if (do_sendfile && do_compress) {
+            printf("sendfile can't send compressed data, reading the file instead\n");
+            do_sendfile = 0;
+        }
+        if (do_sendfile && do_jana) {
+            printf("sendfile is not supported in jana mode, reading the file instead\n");
+            do_sendfile = 0;
+        }
+        if (do_sendfile) {
+            struct stat st;
+            fstat(of, &st);
+            data_fd = of;
+            data_file_size = st.st_size;
+            printf("Sending file data with sendfile\n");
+        }
+    }
+    // With compression every buffer also holds its compressed image
+    size_t buffer_size = master_data->total_length;
+    if (do_compress) {
+        wire_offset = (master_data->total_length + STREAM_CACHE_LINE - 1) & ~(STREAM_CACHE_LINE - 1);
+        wire_capacity = (stream_codec_bound(codec, master_data->payload_length) + 3) & ~3;
+        buffer_size = wire_offset + sizeof(stream_buffer_t) + wire_capacity;
     }
-    // Pop four copies of master_data on "free buffer" queue...
-    for (ix = 0; ix < 4; ix++) {
-        char *tmp = malloc(master_data->total_length);
+    // A payload area of a word or so has no room for the pointer, so it goes after it
+    if (replay_map != NULL) {
+        replay_slot = (buffer_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        buffer_size = replay_slot + sizeof(void *);
+    }
+    // Pop pool_size copies of master_data on each stream's "free buffer" queue...
+    for (ix = 0; ix < stream_count * pool_size; ix++) {
+        source_stream_t *st = &streams[ix / pool_size];
+        if (ix % pool_size == 0)
+            st->free_queue = stream_queue_create(pool_size, STREAM_QUEUE_SPSC, wait_strategy);
+        stream_buffer_t *tmp = malloc(buffer_size);
         if (tmp == NULL) {
-            printf("cannot allocate buffer of %d bytes\n", request_length);
+            printf("cannot allocate buffer of %d bytes\n", (int) buffer_size);
             exit(-1);
         }
         bcopy(master_data, tmp, master_data->total_length);
-        stream_queue_add(free_buffer_queue, tmp);
+        tmp->source_id = st->source_id;
+        stream_queue_add(st->free_queue, tmp);
     }
     // We are going to time things to see how fast they are.
     struct timespec tvBegin, tvStartBlock;
-    //snappy_init_env(&env);
     // Set tvBegin to the current time.
     clock_gettime(CLOCK_REALTIME, &tvBegin);
     clock_gettime(CLOCK_REALTIME, &tvStartBlock);
+    test_start = tvBegin;
     // Set up the queues etc for the writer and compression threads.
-    // We will have four data compression threads, create management structures
-    int out_depth = 4;
-    // compression_stream_t compressors[out_depth];
-    struct ringBuffer *out_queue = stream_queue_create(out_depth);
-    pthread_t writer_pthread_id;
-    pthread_create(&writer_pthread_id, NULL, writer_thread, (void *) out_queue);
-    /*if (do_compress) {
-        int i;
-        // Need some queues and some threads each with an in and out queue...
-        for (i = 0; i < out_depth; i++) {
-            compressors[i].in_queue = stream_queue_create(in_depth);
-            compressors[i].out_queue = out_queue;
-            pthread_t worker;
-            pthread_create(&worker, NULL, compression_thread,
-                    (void *) &compressors[i]);
+    // Each stream has compress_workers compression threads, each with an in and out queue.
+    int out_depth = pool_size;
+    for (ix = 0; ix < stream_count; ix++) {
+        source_stream_t *st = &streams[ix];
+        if (do_compress) {
+            int i;
+            st->compressors = calloc(compress_workers, sizeof(compression_stream_t));
+            for (i = 0; i < compress_workers; i++) {
+                st->compressors[i].in_queue = stream_queue_create(out_depth, STREAM_QUEUE_SPSC, wait_strategy);
+                st->compressors[i].out_queue = stream_queue_create(out_depth, STREAM_QUEUE_SPSC, wait_strategy);
+                pthread_create(&st->compressors[i].thread, NULL, compression_thread,
+                        (void *) &st->compressors[i]);
+            }
         }
-    }*/
+        else
+            st->out_queue = stream_queue_create(out_depth, STREAM_QUEUE_SPSC, wait_strategy);
+        pthread_create(&st->writer, NULL, writer_thread, (void *) st);
+    }
     // Loop sending batches of buffers and measure rate between batches
     int buf_count;
     // save start time
@@ -517,8 +1221,15 @@ int main(int argc, char *argv[]) {
     bcopy(&tvStartBlock, &time_then, sizeof(struct timespec));
     uint32_t current_length = master_data->total_length / total_cycles;
     current_length = ((current_length + 3) / 4) << 2;
+    if (replay_file != NULL) {
+        data_rates = (double *) malloc(1000000 * sizeof(double));
+        block_rates = (double *) malloc(1000000 * sizeof(double));
+        // Report every 10000 records rather than every -n
+        loops_per_cycle = 10000;
+        replay(&delay, &tvStartBlock);
+    }
     // if there no data file, handle it
-    if (data_file == NULL) {
+    else if (data_file == NULL) {
         // store the data rates for total_cycles (-n) buffers
         data_rates  = (double *) malloc(total_cycles * sizeof(double));
         block_rates = (double *) malloc(total_cycles * sizeof(double));
@@ -526,13 +1237,12 @@ int main(int argc, char *argv[]) {
             // pop new free buffer off the queue
             stream_buffer_t *buf;
             // pull an "incoming" buffer off the queue
-            buf = stream_queue_get(free_buffer_queue);
-            buf->record_counter = buf_count;
+            buf = take_buffer();
             // acquire the clock time
-            clock_gettime(CLOCK_REALTIME, &buf->timestamp);
+            clock_gettime(stamp_clock_id, &buf->timestamp);
             if (do_scan) buf->total_length = current_length;
             // Put it on the outgoing queue.
-            stream_queue_add(out_queue, buf);
+            queue_buffer(buf);
             // print rate diagnostics and handle the timing
             if ((buf_count != 0) && ((buf_count % loops_per_cycle) == 0)) {
                 print_rate(&tvStartBlock, master_data->total_length);
@@ -559,8 +1269,7 @@ int main(int argc, char *argv[]) {
         stream_buffer_t *fbuf;
         int nread, buf_cntr = 0;
         // pop new free buffer off the queue
-        fbuf = stream_queue_get(free_buffer_queue);
-        // increment and update buffer counter
+        fbuf = take_buffer();
 
         size_t event_size_bytes = fbuf->payload_length;
 
@@ -585,20 +1294,19 @@ int main(int argc, char *argv[]) {
                 // Set fields, indicating if we've reached EOF or not
                 if (fbuf->payload_length < event_size_bytes || feof(jf)) {
                     finished = true;
-                    fbuf->flags = 1;
+                    fbuf->flags = STREAM_FLAG_LAST;
                 }
                 else {
                     fbuf->flags = 0;
                 }
-                fbuf->record_counter = ++buf_cntr;
-                clock_gettime(CLOCK_REALTIME, &fbuf->timestamp);
+                clock_gettime(stamp_clock_id, &fbuf->timestamp);
 
                 // Print rates
                 printf("Sending event# %llu, ", fbuf->record_counter);
                 print_rate(&tvStartBlock, fbuf->payload_length + sizeof(stream_buffer_t));
 
                 // Push buffer onto 'send' queue
-                stream_queue_add(out_queue, fbuf);
+                queue_buffer(fbuf);
 
                 // Iterate lengths and append clock time
                 current_length += master_data->total_length;
@@ -606,14 +1314,14 @@ int main(int argc, char *argv[]) {
                 clock_gettime(CLOCK_REALTIME, &tvStartBlock);
 
                 // Pop buffer off of 'free' queue
-                fbuf = stream_queue_get(free_buffer_queue);
+                fbuf = take_buffer();
             }
             printf("\nEnd of file %s reached...\n", data_file);
             fclose(jf);
         }
         else {
             // read from file and assign payload to file buffer
-            nread = read(of, fbuf->payload, (int) fbuf->payload_length);
+            nread = read_chunk(of, fbuf, (int) fbuf->payload_length);
             // check for read errors
             if (nread <= 0) {
                 printf("\n!!! Error reading file %s !!!\n", data_file);
@@ -622,17 +1330,17 @@ int main(int argc, char *argv[]) {
             // loop over the data file
             while (nread > 0) {
                 // acquire the clock time
-                clock_gettime(CLOCK_REALTIME, &fbuf->timestamp);
+                clock_gettime(stamp_clock_id, &fbuf->timestamp);
                 // handle the case where payload length is larger than the read
                 if (nread < (int) fbuf->payload_length) {
                     // adjust the buffer payload to match the length of the read
                     fbuf->payload_length = nread;
                     // set the end of file flag to true and read to zero
-                    fbuf->flags = 1;
+                    fbuf->flags = STREAM_FLAG_LAST;
                     nread = 0;
                     // send the buffer and print rate diagnostics
-                    stream_queue_add(out_queue, fbuf);
                     printf("\nbuffer counter = %d, ", (int) fbuf->record_counter);
+                    queue_buffer(fbuf);
                     print_rate(&tvStartBlock, fbuf->payload_length + sizeof(stream_buffer_t));
                     printf("\nEnd of file %s reached...\n", data_file);
                     break;
@@ -642,9 +1350,10 @@ int main(int argc, char *argv[]) {
                 if (nread == (int) fbuf->payload_length)
                     fbuf->flags = 0;
                 // send the buffer and print rate diagnostics
-                stream_queue_add(out_queue, fbuf);
-                if ((buf_cntr <= 10) || (buf_cntr % 1000 == 0)) {
+                if ((buf_cntr <= 10) || (buf_cntr % 1000 == 0))
                     printf("\nbuffer counter = %d, ", (int) fbuf->record_counter);
+                queue_buffer(fbuf);
+                if ((buf_cntr <= 10) || (buf_cntr % 1000 == 0)) {
                     print_rate(&tvStartBlock, fbuf->payload_length + sizeof(stream_buffer_t));
                 }
                 // iterate lengths and append clock time
@@ -652,19 +1361,18 @@ int main(int argc, char *argv[]) {
                 current_length = ((current_length + 3) / 4) << 2;
                 clock_gettime(CLOCK_REALTIME, &tvStartBlock);
                 // pop new free buffer off queue
-                fbuf = stream_queue_get(free_buffer_queue);
-                // increment and update buffer counter
+                fbuf = take_buffer();
+                // increment buffer counter
                 buf_cntr++;
-                fbuf->record_counter = buf_cntr;
                 // read next chunk of file and assign it to the file buffer
-                nread = read(of, fbuf->payload, (int) fbuf->payload_length);
+                nread = read_chunk(of, fbuf, (int) fbuf->payload_length);
                 if (nread == -1) {
                     printf("\n!!! Error reading file %s!!!\n", data_file);
                     exit(-1);
                 }
             } // file read while loop
-            // close the file when eof is reached
-            if (nread == 0) {
+            // close the file when eof is reached, unless the writer still sends from it
+            if (nread == 0 && !do_sendfile) {
                 cf = close(of);
                 if (cf == 0) printf("Successfully closed source file %s\n", data_file);
                 if (cf == -1) {
@@ -674,11 +1382,23 @@ int main(int argc, char *argv[]) {
             }
         } // jana condition
     } // data file condition
-    // tell the writer thread to quit
-    stream_queue_add(out_queue, (stream_buffer_t *) - 1);
-    void *retval;
-    pthread_join(writer_pthread_id, &retval);
-    close(target_socket);
+    // tell the compression and writer threads to quit, every worker gets an end marker
+    // and the writer stops at the first it collects
+    for (ix = 0; ix < stream_count; ix++) {
+        int i;
+        for (i = 0; i < (do_compress ? compress_workers : 1); i++)
+            submit_buffer(&streams[ix], (stream_buffer_t *) - 1);
+    }
+    for (ix = 0; ix < stream_count; ix++) {
+        void *retval;
+        int i;
+        for (i = 0; do_compress && i < compress_workers; i++)
+            pthread_join(streams[ix].compressors[i].thread, &retval);
+        pthread_join(streams[ix].writer, &retval);
+        close(streams[ix].socket);
+    }
+    if (data_fd >= 0)
+        close(data_fd);
     // print average rates
     printf("Average rates : ");
     print_final_stats();
@@ -5,8 +5,10 @@
  *      Author: heyes
  */
 
+#include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -18,10 +20,73 @@
 #include <unistd.h>
 
 #include "stream_tools.h"
+#include "stream_codec.h"
+#include "stream_recorder.h"
 
 int do_debug = 0;
 char *data_file;
 int of, wf, cf;
+// Compressed payloads are expanded here before they are written with -f
+uint8_t *expand = NULL;
+size_t expand_size = 0;
+// Whole records are recorded with -r, see stream_recorder.h
+char *record_prefix;
+uint64_t rotate_bytes = 0;
+int rotate_seconds = 0;
+int record_direct = 0;
+#define RECORD_BUFFER (16 * 1024 * 1024)
+// Latency from the record timestamp to receipt, set by -l
+int do_latency = 0;
+#define LATENCY_INTERVAL 10
+// record_counter tracking per source, off when the router is asked to skip records
+int do_sequence = 1;
+#define SEQUENCE_SOURCES 256
+stream_sequence_t *sequences;
+int sequence_count = 0;
+struct timespec sequence_report;
+
+// Tracker for a source, NULL once SEQUENCE_SOURCES are tracked
+stream_sequence_t *sequence_find(uint32_t source_id) {
+    static int last = 0;
+    int i;
+    if (last < sequence_count && sequences[last].source_id == source_id)
+        return &sequences[last];
+    for (i = 0; i < sequence_count; i++)
+        if (sequences[i].source_id == source_id)
+            break;
+    if (i == SEQUENCE_SOURCES)
+        return NULL;
+    if (i == sequence_count) {
+        sequences[i].source_id = source_id;
+        sequence_count++;
+    }
+    last = i;
+    return &sequences[i];
+}
+
+// Every 10 seconds print the sources that have had gaps, duplicates or reordering since
+// the last time, or all of them at the end.
+void sequence_print(int final) {
+    int i;
+    if (!final) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        if (now.tv_sec - sequence_report.tv_sec < 10)
+            return;
+        sequence_report = now;
+    }
+    for (i = 0; i < sequence_count; i++) {
+        stream_sequence_t *s = &sequences[i];
+        if (final || stream_sequence_anomalies(s) != s->reported)
+            stream_sequence_print(s);
+        s->reported = stream_sequence_anomalies(s);
+    }
+}
+volatile sig_atomic_t keep_going = 1;
+
+void cc_handler(int signum) {
+    keep_going = 0;
+}
 
 char *date(void) {
     time_t now = time(&now);
@@ -32,17 +97,30 @@ char *date(void) {
 }
 
 void print_usage(char *pname) {
-    printf("usage: %s [-v] [-f file] [-u url] <key>\n\n", pname);
-    printf("\t<key>: four byte hex source ID to match\n");
+    printf("usage: %s [-v] [-f file] [-r prefix [-s MB] [-t seconds] [-d]] [-l] [-u url] [-n every] [-m mask/value] [-a after] [-b before] <key>\n\n", pname);
+    printf("\t<key>: four byte hex source ID to match, with a filter several can be given separated by commas\n");
     printf("\t-v: increment debug level\n");
     printf("\t-f: name of file to write buffers too\n");
+    printf("\t-r <prefix>: record whole records to <prefix>-<n>.dat with an index in <prefix>-<n>.idx\n");
+    printf("\t-s <MB>: with -r start a new file after this many MB\n");
+    printf("\t-t <seconds>: with -r start a new file after this many seconds\n");
+    printf("\t-d: with -r write the files O_DIRECT\n");
+    printf("\t-l: print latency from the record timestamps every 10s and at the end\n");
+    printf("\t-u: URL to subscribe to, several can be given separated by commas\n");
+    printf("The router applies these filters when it is run with -x:\n");
+    printf("\t-n <n>: only one in every n records\n");
+    printf("\t-m <mask/value>: only records with (flags & mask) == value\n");
+    printf("\t-a <seconds>: only records with a timestamp at or after this\n");
+    printf("\t-b <seconds>: only records with a timestamp before this\n");
 }
 
 int main(int argc, char **argv) {
     // Handle command line arguments
     char opt;
-    char *url = "tcp://127.0.0.1:5556";
-    while ((opt = getopt(argc, argv, "vu:f:")) != -1) {
+    char *url = strdup("tcp://127.0.0.1:5556");
+    // Filter fields, each one is added to the filter topic as it is given
+    char filter[256] = "";
+    while ((opt = getopt(argc, argv, "vu:f:r:s:t:dln:m:a:b:")) != -1) {
         switch (opt) {
             case 'v':
                 do_debug++;
@@ -55,6 +133,35 @@ int main(int argc, char **argv) {
                 printf("Writing file %s to current working directory\n", optarg);
                 data_file = strdup(optarg);
                 break;
+            case 'r':
+                record_prefix = strdup(optarg);
+                break;
+            case 's':
+                rotate_bytes = strtoull(optarg, NULL, 0) * 1024 * 1024;
+                break;
+            case 't':
+                rotate_seconds = atoi(optarg);
+                break;
+            case 'd':
+                record_direct = 1;
+                break;
+            case 'l':
+                do_latency = 1;
+                break;
+            case 'n':
+                do_sequence = 0;
+                snprintf(filter + strlen(filter), sizeof(filter) - strlen(filter), ";every=%s", optarg);
+                break;
+            case 'm':
+                do_sequence = 0;
+                snprintf(filter + strlen(filter), sizeof(filter) - strlen(filter), ";flags=%s", optarg);
+                break;
+            case 'a':
+                snprintf(filter + strlen(filter), sizeof(filter) - strlen(filter), ";after=%s", optarg);
+                break;
+            case 'b':
+                snprintf(filter + strlen(filter), sizeof(filter) - strlen(filter), ";before=%s", optarg);
+                break;
             default:
                 print_usage(argv[0]);
                 return (0);
@@ -69,41 +176,104 @@ int main(int argc, char **argv) {
     // initialize zmq socket
     void *context = zmq_init(1);
     void *socket = zmq_socket(context, ZMQ_SUB);
-    // configure zmq socket
-    printf("Subscribe to URL: %s\n", url);
-    // create outgoing connection from socket
-    int ret = zmq_connect(socket, url);
-    if (ret < 0) {
-        perror("zmq_connect error :");
-        exit(0);
+    // create an outgoing connection for each comma separated URL, a router with
+    // several output threads publishes on one URL per thread
+    int ret;
+    char *next_url;
+    for (next_url = strtok(url, ","); next_url != NULL; next_url = strtok(NULL, ",")) {
+        printf("Subscribe to URL: %s\n", next_url);
+        ret = zmq_connect(socket, next_url);
+        if (ret < 0) {
+            perror("zmq_connect error :");
+            exit(0);
+        }
+    }
+    // set zmq socket options, a list of sources or any filter field needs a filter that the
+    // router applies, otherwise ZMQ matches the source ID at the start of each record
+    char topic[300];
+    if (filter[0] != '\0' || strchr(argv[optind], ',') != NULL) {
+        snprintf(topic, sizeof(topic), "%ssrc=%s%s", STREAM_FILTER_PREFIX, argv[optind], filter);
+        printf("Filter = %s\n", topic);
+        ret = zmq_setsockopt(socket, ZMQ_SUBSCRIBE, topic, strlen(topic));
+    }
+    else {
+        printf("Filter = %08x\n", source_id);
+        ret = zmq_setsockopt(socket, ZMQ_SUBSCRIBE, &source_id, 4);
     }
-    // set zmq socket options
-    printf("Filter = %08x\n", source_id);
-    ret = zmq_setsockopt(socket, ZMQ_SUBSCRIBE, &source_id, 4);
     if (ret < 0) {
         perror("zmq_setsockopt error :");
       exit(0);
     }
     // create the data file to write too
     if (data_file != NULL) {
-        of = open(data_file, O_RDWR | O_CREAT);
-        if (!of) {printf("Error opening file %s\n", data_file); exit(-1);}
+        of = open(data_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (of < 0) {printf("Error opening file %s\n", data_file); exit(-1);}
+    }
+    stream_recorder_t *recorder = NULL;
+    if (record_prefix != NULL) {
+        recorder = stream_recorder_open(record_prefix, RECORD_BUFFER, rotate_bytes, rotate_seconds, record_direct);
+        if (recorder == NULL) {printf("Error opening recording %s\n", record_prefix); exit(-1);}
+        printf("Recording to %s-*.dat\n", record_prefix);
     }
+    if (do_sequence) {
+        sequences = calloc(SEQUENCE_SOURCES, sizeof(stream_sequence_t));
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &sequence_report);
+    }
+    else
+        printf("The router skips records for -n or -m, not checking record counters\n");
+    stream_latency_t *latency = NULL;
+    if (do_latency)
+        latency = stream_latency_create("receive", LATENCY_INTERVAL);
+    // Stop cleanly on ^C so that whatever is buffered gets written
+    signal(SIGINT, cc_handler);
     // subscribe to zmq socket
     printf("Subscribing to data source %08X\n", source_id);
-    for (;;) {
+    while (keep_going) {
         // recieve a message part from a socket
         zmq_msg_t msg;
         zmq_msg_init(&msg);
         ret = zmq_recvmsg(socket, &msg, 0);
         if (ret < 0) {
+            if (errno == EINTR)
+                break;
             perror("zmq_recvmsg error :");
             exit(0);
         }
+        // a frame from the router's frame builder starts with a frame header part, the
+        // records follow as parts of their own and are handled like any other record
+        stream_frame_t *frame = (stream_frame_t *) zmq_msg_data(&msg);
+        // with a filter each record comes after a part holding the filter topic
+        if (zmq_msg_size(&msg) >= strlen(STREAM_FILTER_PREFIX) &&
+            memcmp(zmq_msg_data(&msg), STREAM_FILTER_PREFIX, strlen(STREAM_FILTER_PREFIX)) == 0) {
+            zmq_msg_close(&msg);
+            continue;
+        }
+        if (zmq_msg_size(&msg) == sizeof(stream_frame_t) && frame->frame_id == STREAM_FRAME_ID) {
+            if ((frame->frame_number % 1000 == 0) || frame->missing > 0 || do_debug > 0)
+                printf("frame %" PRIu64 ", %d records from %d sources, %d sources missing\n",
+                       frame->frame_number, frame->records, frame->sources, frame->missing);
+            zmq_msg_close(&msg);
+            continue;
+        }
         // handle the buffer
         stream_buffer_t *buf = (stream_buffer_t *) zmq_msg_data(&msg);
+        if (do_sequence) {
+            stream_sequence_t *s = sequence_find(buf->source_id);
+            if (s != NULL) {
+                stream_sequence_result_t seq = stream_sequence_check(s, buf->record_counter);
+                if (seq != STREAM_SEQ_OK)
+                    stream_sequence_alert(s, seq, buf->record_counter);
+            }
+            sequence_print(FALSE);
+        }
+        if (latency != NULL) {
+            struct timespec now;
+            stream_clock_now(buf->flags, &now);
+            stream_latency_record(latency, buf, &now);
+            stream_latency_tick(latency);
+        }
         // print debug output
-        if ((buf->record_counter <= 10) || (buf->record_counter % 1000 == 0) || buf->flags == 1) {
+        if ((buf->record_counter <= 10) || (buf->record_counter % 1000 == 0) || (buf->flags & STREAM_FLAG_LAST)) {
             // recieve message content size in bytes
             int size = zmq_msg_size(&msg);
             // print debug messages
@@ -116,18 +286,59 @@ int main(int argc, char **argv) {
         } // buffer print condition
         // hand the data file
         if (data_file != NULL) {
-            // write buffer payload to the open file
-            wf = write(of, buf->payload, buf->payload_length);
-            if (!wf) {printf ("Error while writing file %s\n", data_file); exit(-1);}
+            // write buffer payload to the open file, the message only holds compressed_length
+            // bytes of a compressed payload so that is expanded first
+            void *payload = buf->payload;
+            ssize_t length = buf->payload_length;
+            stream_codec_t codec = stream_codec_of(buf->flags);
+            if (codec != STREAM_CODEC_NONE && !(buf->flags & STREAM_FLAG_TRUNCATED)) {
+                if (expand_size < buf->payload_length) {
+                    expand_size = buf->payload_length;
+                    expand = realloc(expand, expand_size);
+                }
+                length = stream_codec_decompress(codec, buf->payload, buf->compressed_length, expand, expand_size);
+                if (length != buf->payload_length) {
+                    printf("ID %08X record %" PRIu64 " can't be expanded with %s\n", buf->source_id,
+                           buf->record_counter, stream_codec_name(codec));
+                    exit(-1);
+                }
+                payload = expand;
+            }
+            else if (codec != STREAM_CODEC_NONE)
+                length = buf->compressed_length;
+            wf = write(of, payload, length);
+            if (wf != length) {printf ("Error while writing file %s\n", data_file); exit(-1);}
         } // data file condition
-        if (data_file != NULL && buf->flags == 1) {
-            // release the message and exit the infinite for loop
+        if (recorder != NULL && stream_recorder_write(recorder, buf, zmq_msg_size(&msg)) < 0) {
+            printf("Error while recording %s\n", record_prefix);
+            exit(-1);
+        }
+        if ((data_file != NULL || recorder != NULL) && (buf->flags & STREAM_FLAG_LAST)) {
+            // release the message and exit the receive loop
             zmq_msg_close(&msg);
             break;
         }
         // release the message
         zmq_msg_close(&msg);
-    } // infinite for loop
+    } // receive loop
+    if (do_sequence) {
+        printf("\n");
+        sequence_print(TRUE);
+    }
+    if (latency != NULL) {
+        printf("\n");
+        stream_latency_summary(latency);
+        stream_latency_destroy(latency);
+    }
+    if (recorder != NULL) {
+        uint64_t records = recorder->records, bytes = recorder->bytes;
+        int files = recorder->files;
+        if (stream_recorder_close(recorder) < 0) {
+            printf("Error while recording %s\n", record_prefix);
+            exit(-1);
+        }
+        printf("\nRecorded %" PRIu64 " records, %" PRIu64 " bytes in %d files\n", records, bytes, files);
+    }
     // close the open file
     if (data_file != NULL) {
         cf = close(of);
@@ -7,12 +7,23 @@
 
 #include "stream_tools.h"
 
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <time.h>
 
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
 uint32_t stream_to_int(uint8_t *buf) {
     uint32_t data = (((uint32_t) buf[3]) << 24) + (((uint32_t) buf[2]) << 16)
                     + (((uint32_t) buf[1]) << 8) + ((uint32_t) buf[0]);
@@ -66,43 +77,653 @@ void time_print(struct timespec *tv) {
     printf(" = %s.%09d\n", buffer, (int) tv->tv_nsec);
 }
 
-struct ringBuffer *stream_queue_create(int length) {
+static const char *clock_names[] = {"realtime", "tai", "monotonic"};
+static const clockid_t clock_ids[] = {CLOCK_REALTIME, CLOCK_TAI, CLOCK_MONOTONIC};
+
+int stream_clock_from_name(const char *name) {
+    int i;
+    for (i = 0; i < 3; i++)
+        if (strcmp(name, clock_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char *stream_clock_name(stream_clock_t clock) {
+    return clock_names[clock];
+}
+
+clockid_t stream_clock_id(stream_clock_t clock) {
+    return clock_ids[clock];
+}
+
+void stream_clock_now(uint32_t flags, struct timespec *now) {
+    int clock = (flags & STREAM_FLAG_CLOCK_MASK) >> STREAM_FLAG_CLOCK_SHIFT;
+    clock_gettime(clock < 3 ? clock_ids[clock] : CLOCK_REALTIME, now);
+}
+
+// Values below STREAM_HIST_SUB have a bucket each, above that a bucket covers 1/16 of
+// the power of two the value is in.
+static inline int hist_bucket(uint64_t ns) {
+    if (ns < STREAM_HIST_SUB)
+        return ns;
+    if (ns >> STREAM_HIST_MAX_BITS)
+        ns = (1ULL << STREAM_HIST_MAX_BITS) - 1;
+    int shift = 63 - __builtin_clzll(ns) - STREAM_HIST_SUB_BITS;
+    return (shift + 1) * STREAM_HIST_SUB + (int) (ns >> shift) - STREAM_HIST_SUB;
+}
+
+// Largest value that lands in bucket i
+static uint64_t hist_value(int i) {
+    if (i < STREAM_HIST_SUB)
+        return i;
+    int shift = i / STREAM_HIST_SUB - 1;
+    return ((uint64_t) (i % STREAM_HIST_SUB + STREAM_HIST_SUB + 1) << shift) - 1;
+}
+
+void stream_hist_record(stream_hist_t *h, int64_t ns) {
+    h->count++;
+    if (ns < 0) {
+        h->negative++;
+        ns = 0;
+    }
+    if ((uint64_t) ns > h->max)
+        h->max = ns;
+    h->buckets[hist_bucket(ns)]++;
+}
+
+uint64_t stream_hist_percentile(stream_hist_t *h, double p) {
+    int i;
+    uint64_t seen = 0, target = (uint64_t) (p / 100.0 * h->count + 0.5);
+    if (target < 1)
+        target = 1;
+    for (i = 0; i < STREAM_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+void stream_hist_merge(stream_hist_t *into, stream_hist_t *from) {
+    int i;
+    into->count += from->count;
+    into->negative += from->negative;
+    if (from->max > into->max)
+        into->max = from->max;
+    for (i = 0; i < STREAM_HIST_BUCKETS; i++)
+        into->buckets[i] += from->buckets[i];
+}
+
+void stream_hist_print(const char *label, stream_hist_t *h) {
+    if (h->count == 0) {
+        printf("%s - no records\n", label);
+        return;
+    }
+    printf("%s - %lu records, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us",
+           label, (unsigned long) h->count, stream_hist_percentile(h, 50.0) / 1000.0,
+           stream_hist_percentile(h, 99.0) / 1000.0, stream_hist_percentile(h, 99.9) / 1000.0,
+           h->max / 1000.0);
+    if (h->negative > 0)
+        printf(", %lu stamped in the future", (unsigned long) h->negative);
+    printf("\n");
+}
+
+stream_latency_t *stream_latency_create(const char *name, int interval) {
+    stream_latency_t *l = calloc(1, sizeof(stream_latency_t));
+    snprintf(l->name, sizeof(l->name), "%s", name);
+    l->interval = interval;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &l->last_report);
+    return l;
+}
+
+// Only the owner and stream_latency_snapshot take the lock, so it is nearly always free
+static inline void latency_lock(stream_latency_t *l) {
+    while (atomic_exchange_explicit(&l->lock, 1, memory_order_acquire))
+        cpu_relax();
+}
+
+static inline void latency_unlock(stream_latency_t *l) {
+    atomic_store_explicit(&l->lock, 0, memory_order_release);
+}
+
+void stream_latency_record(stream_latency_t *l, stream_buffer_t *buf, struct timespec *now) {
+    int i = l->last;
+    int count = atomic_load_explicit(&l->count, memory_order_relaxed);
+    // Nearly always the same source as last time
+    if (i >= count || l->source_id[i] != buf->source_id) {
+        for (i = 0; i < count; i++)
+            if (l->source_id[i] == buf->source_id)
+                break;
+        if (i == count) {
+            if (count == STREAM_LATENCY_SOURCES)
+                return;
+            l->source_id[i] = buf->source_id;
+            l->recent[i] = calloc(1, sizeof(stream_hist_t));
+            l->total[i] = calloc(1, sizeof(stream_hist_t));
+            atomic_store_explicit(&l->count, count + 1, memory_order_release);
+        }
+        l->last = i;
+    }
+    int64_t ns = (int64_t) (now->tv_sec - buf->timestamp.tv_sec) * 1000000000
+                 + (now->tv_nsec - buf->timestamp.tv_nsec);
+    latency_lock(l);
+    stream_hist_record(l->recent[i], ns);
+    latency_unlock(l);
+}
+
+static void latency_report(stream_latency_t *l, int summary) {
+    int i;
+    char label[64];
+    int count = atomic_load_explicit(&l->count, memory_order_relaxed);
+    for (i = 0; i < count; i++) {
+        stream_hist_t *h = l->recent[i];
+        // Only this thread changes the histograms, printing them needs no lock
+        latency_lock(l);
+        stream_hist_merge(l->total[i], h);
+        latency_unlock(l);
+        if (summary)
+            h = l->total[i];
+        snprintf(label, sizeof(label), "ID %08X %s latency%s", l->source_id[i], l->name,
+                 summary ? " summary" : "");
+        if (h->count > 0 || summary)
+            stream_hist_print(label, h);
+        latency_lock(l);
+        memset(l->recent[i], 0, sizeof(stream_hist_t));
+        latency_unlock(l);
+    }
+}
+
+void stream_latency_tick(stream_latency_t *l) {
+    struct timespec now;
+    if (l->interval == 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (now.tv_sec - l->last_report.tv_sec < l->interval)
+        return;
+    l->last_report = now;
+    latency_report(l, FALSE);
+}
+
+void stream_latency_summary(stream_latency_t *l) {
+    latency_report(l, TRUE);
+}
+
+int stream_latency_count(stream_latency_t *l) {
+    return atomic_load_explicit(&l->count, memory_order_acquire);
+}
+
+uint32_t stream_latency_snapshot(stream_latency_t *l, int i, stream_hist_t *h) {
+    latency_lock(l);
+    memcpy(h, l->total[i], sizeof(stream_hist_t));
+    stream_hist_merge(h, l->recent[i]);
+    latency_unlock(l);
+    return l->source_id[i];
+}
+
+void stream_latency_destroy(stream_latency_t *l) {
+    int i;
+    for (i = 0; i < l->count; i++) {
+        free(l->recent[i]);
+        free(l->total[i]);
+    }
+    free(l);
+}
+
+static inline void sequence_set(stream_sequence_t *s, uint64_t counter, int on) {
+    uint64_t bit = 1ULL << (counter % 64);
+    if (on)
+        s->window[(counter % STREAM_SEQUENCE_WINDOW) / 64] |= bit;
+    else
+        s->window[(counter % STREAM_SEQUENCE_WINDOW) / 64] &= ~bit;
+}
+
+stream_sequence_result_t stream_sequence_slow(stream_sequence_t *s, uint64_t counter) {
+    uint64_t c;
+    s->received++;
+    if (!s->started || (counter < s->next && s->next - counter > STREAM_SEQUENCE_WINDOW)) {
+        stream_sequence_result_t result = s->started ? STREAM_SEQ_RESTART : STREAM_SEQ_OK;
+        if (s->started)
+            s->restarts++;
+        s->started = TRUE;
+        memset(s->window, 0, sizeof(s->window));
+        sequence_set(s, counter, TRUE);
+        s->next = counter + 1;
+        return result;
+    }
+    if (counter < s->next) {
+        uint64_t bit = 1ULL << (counter % 64);
+        if (s->window[(counter % STREAM_SEQUENCE_WINDOW) / 64] & bit) {
+            s->duplicates++;
+            return STREAM_SEQ_DUPLICATE;
+        }
+        sequence_set(s, counter, TRUE);
+        s->reordered++;
+        if (s->missing > 0)
+            s->missing--;
+        return STREAM_SEQ_REORDERED;
+    }
+    // Skipped counters are cleared, a gap bigger than the window clears all of it
+    if (counter - s->next >= STREAM_SEQUENCE_WINDOW)
+        memset(s->window, 0, sizeof(s->window));
+    else
+        for (c = s->next; c < counter; c++)
+            sequence_set(s, c, FALSE);
+    sequence_set(s, counter, TRUE);
+    s->gaps++;
+    s->missing += counter - s->next;
+    s->last_gap[0] = s->next;
+    s->last_gap[1] = counter - 1;
+    if (s->gaps == 1) {
+        s->first_gap[0] = s->last_gap[0];
+        s->first_gap[1] = s->last_gap[1];
+    }
+    s->next = counter + 1;
+    return STREAM_SEQ_GAP;
+}
+
+void stream_sequence_alert(stream_sequence_t *s, stream_sequence_result_t result, uint64_t counter) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (now.tv_sec == s->last_alert) {
+        s->alerts_suppressed++;
+        return;
+    }
+    s->last_alert = now.tv_sec;
+    printf("ID %08X - ", s->source_id);
+    switch (result) {
+        case STREAM_SEQ_GAP:
+            printf("records %lu to %lu missing", (unsigned long) s->last_gap[0], (unsigned long) s->last_gap[1]);
+            break;
+        case STREAM_SEQ_REORDERED:
+            printf("record %lu arrived out of order", (unsigned long) counter);
+            break;
+        case STREAM_SEQ_DUPLICATE:
+            printf("record %lu arrived again", (unsigned long) counter);
+            break;
+        case STREAM_SEQ_RESTART:
+            printf("record counter went back to %lu, source restarted?", (unsigned long) counter);
+            break;
+        default:
+            break;
+    }
+    if (s->alerts_suppressed > 0)
+        printf(" (%lu more since the last message)", (unsigned long) s->alerts_suppressed);
+    printf("\n");
+    s->alerts_suppressed = 0;
+}
+
+void stream_sequence_print(stream_sequence_t *s) {
+    printf("ID %08X - %lu records, ", s->source_id, (unsigned long) s->received);
+    if (s->gaps == 0)
+        printf("no gaps");
+    else if (s->gaps == 1)
+        printf("%lu missing in 1 gap (%lu-%lu)", (unsigned long) s->missing,
+               (unsigned long) s->first_gap[0], (unsigned long) s->first_gap[1]);
+    else
+        printf("%lu missing in %lu gaps (first %lu-%lu, last %lu-%lu)", (unsigned long) s->missing,
+               (unsigned long) s->gaps, (unsigned long) s->first_gap[0], (unsigned long) s->first_gap[1],
+               (unsigned long) s->last_gap[0], (unsigned long) s->last_gap[1]);
+    printf(", %lu reordered, %lu duplicates", (unsigned long) s->reordered, (unsigned long) s->duplicates);
+    if (s->restarts > 0)
+        printf(", %lu restarts", (unsigned long) s->restarts);
+    printf("\n");
+}
+
+// Number of polls before STREAM_WAIT_YIELD and STREAM_WAIT_BLOCK back off.
+#define STREAM_SPIN_LIMIT 1000
+
+static const char *wait_names[] = {"sleep", "spin", "yield", "block"};
+
+int stream_wait_from_name(const char *name) {
+    int i;
+    for (i = 0; i < sizeof(wait_names) / sizeof(wait_names[0]); i++)
+        if (strcmp(name, wait_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+const char *stream_wait_name(stream_wait_t wait) {
+    return wait_names[wait];
+}
+
+// Back off once after a failed poll. Returns -1 if the wait was interrupted, the
+// sleep strategy relies on this so that a signal can break a consumer out of its wait.
+static int backoff(struct ringBuffer *buf, int spins) {
+    switch (buf->wait) {
+        case STREAM_WAIT_SPIN:
+            cpu_relax();
+            return 0;
+        case STREAM_WAIT_YIELD:
+        case STREAM_WAIT_BLOCK:
+            if (spins < STREAM_SPIN_LIMIT)
+                cpu_relax();
+            else
+                sched_yield();
+            return 0;
+        default:
+            return usleep(10);
+    }
+}
+
+// Blocking mode: a waiter announces itself before re-checking the ring and the other
+// side checks the waiter count after publishing. The fences make both sequentially
+// consistent so at least one of them sees the other and no wakeup is lost.
+static void wake(struct ringBuffer *buf, _Atomic int *waiting, pthread_cond_t *cond) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) == 0)
+        return;
+    pthread_mutex_lock(&buf->lock);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&buf->lock);
+}
+
+static void wait_begin(struct ringBuffer *buf, _Atomic int *waiting) {
+    pthread_mutex_lock(&buf->lock);
+    atomic_fetch_add(waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void wait_end(struct ringBuffer *buf, _Atomic int *waiting) {
+    atomic_fetch_sub(waiting, 1);
+    pthread_mutex_unlock(&buf->lock);
+}
+
+struct ringBuffer *stream_queue_create(int length, stream_queue_type_t type, stream_wait_t wait) {
     //create the ring buffer
-    struct ringBuffer *buf = calloc(1, sizeof(struct ringBuffer));
-    buf->buffer = calloc(length, sizeof(void *));
-    buf->size = length;
+    struct ringBuffer *buf;
+    size_t size = 1;
+    while (size < length)
+        size <<= 1;
+    if (posix_memalign((void **) &buf, STREAM_CACHE_LINE, sizeof(struct ringBuffer)) != 0)
+        return NULL;
+    memset(buf, 0, sizeof(struct ringBuffer));
+    buf->buffer = calloc(size, sizeof(void *));
+    buf->size = size;
+    buf->mask = size - 1;
+    buf->type = type;
+    buf->wait = wait;
+    pthread_mutex_init(&buf->lock, NULL);
+    pthread_cond_init(&buf->not_empty, NULL);
+    pthread_cond_init(&buf->not_full, NULL);
     return buf;
 }
 
-//producer
-void stream_queue_add(struct ringBuffer *buf, void *newValue) {
-    uint64_t writepos = __sync_fetch_and_add(&buf->writePosition, 1)
-                        % buf->size;
+// Claim up to count consecutive slots, returns how many were claimed starting at *first.
+// A slot may only be reused once the consumer has cleared it. The consumer clears slots
+// before its release store of readPosition, and cachedRead passes that on to every
+// producer with a release store and an acquire load, so a producer that sees room also
+// sees the slots cleared.
+static int claim(struct ringBuffer *buf, int count, uint64_t *first) {
+    uint64_t w = atomic_load_explicit(&buf->writePosition, memory_order_relaxed);
+    uint64_t r = atomic_load_explicit(&buf->cachedRead, memory_order_acquire);
+    for (;;) {
+        // cachedRead may be older than w by more than size when other producers have
+        // moved on, so guard the subtraction.
+        uint64_t room = (w - r < buf->size) ? buf->size - (w - r) : 0;
+        if (room < count) {
+            r = atomic_load_explicit(&buf->readPosition, memory_order_acquire);
+            atomic_store_explicit(&buf->cachedRead, r, memory_order_release);
+            room = buf->size - (w - r);
+            if (room == 0)
+                return 0;
+        }
+        int n = room < count ? (int) room : count;
+        if (buf->type == STREAM_QUEUE_SPSC) {
+            *first = w;
+            return n;
+        }
+        // MPSC, another producer may have got there first in which case w is reloaded.
+        if (atomic_compare_exchange_weak_explicit(&buf->writePosition, &w, w + n,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            *first = w;
+            return n;
+        }
+    }
+}
 
-    //spin lock until buffer space available
-    while (!__sync_bool_compare_and_swap(&(buf->buffer[writepos]), NULL,
-                                         newValue))
-        if (usleep(10) < 0) usleep(10);
+static int try_add_batch(struct ringBuffer *buf, void **values, int count) {
+    uint64_t first;
+    int i, n = claim(buf, count, &first);
+    // A non-NULL slot is what tells the MPSC consumer that a claimed slot has been filled.
+    for (i = 0; i < n; i++)
+        atomic_store_explicit(&buf->buffer[(first + i) & buf->mask], values[i], memory_order_release);
+    if (n > 0 && buf->type == STREAM_QUEUE_SPSC)
+        atomic_store_explicit(&buf->writePosition, first + n, memory_order_release);
+    return n;
+}
 
-    //sem_post(buf->semaphore);
+static void consumer_lock(struct ringBuffer *buf) {
+    while (atomic_exchange_explicit(&buf->consumer_lock, 1, memory_order_acquire))
+        cpu_relax();
 }
 
-//consumer
-void *stream_queue_get(struct ringBuffer *buf) {
+static void consumer_unlock(struct ringBuffer *buf) {
+    atomic_store_explicit(&buf->consumer_lock, 0, memory_order_release);
+}
+
+static int take_batch(struct ringBuffer *buf, void **values, int max) {
+    uint64_t r = atomic_load_explicit(&buf->readPosition, memory_order_relaxed);
+    int n = 0;
+    if (buf->type == STREAM_QUEUE_SPSC) {
+        if (buf->cachedWrite - r < max)
+            buf->cachedWrite = atomic_load_explicit(&buf->writePosition, memory_order_acquire);
+        uint64_t avail = buf->cachedWrite - r;
+        for (; n < max && n < avail; n++)
+            values[n] = atomic_load_explicit(&buf->buffer[(r + n) & buf->mask], memory_order_relaxed);
+    }
+    else {
+        // MPSC, slots are claimed in order but may be filled out of order so stop at the
+        // first one that hasn't been filled yet.
+        for (; n < max; n++) {
+            _Atomic(void *) *slot = &buf->buffer[(r + n) & buf->mask];
+            void *value = atomic_load_explicit(slot, memory_order_acquire);
+            if (value == NULL)
+                break;
+            atomic_store_explicit(slot, NULL, memory_order_relaxed);
+            values[n] = value;
+        }
+    }
+    if (n > 0)
+        atomic_store_explicit(&buf->readPosition, r + n, memory_order_release);
+    return n;
+}
+
+static int try_get_batch(struct ringBuffer *buf, void **values, int max) {
+    if (!buf->evictable)
+        return take_batch(buf, values, max);
+    consumer_lock(buf);
+    int n = take_batch(buf, values, max);
+    consumer_unlock(buf);
+    return n;
+}
+
+void stream_queue_allow_evict(struct ringBuffer *buf) {
+    buf->evictable = TRUE;
+}
+
+void *stream_queue_evict(struct ringBuffer *buf) {
+    void *value;
+    consumer_lock(buf);
+    int n = take_batch(buf, &value, 1);
+    consumer_unlock(buf);
+    if (n > 0 && buf->wait == STREAM_WAIT_BLOCK)
+        wake(buf, &buf->writers_waiting, &buf->not_full);
+    return n > 0 ? value : NULL;
+}
+
+int stream_queue_count(struct ringBuffer *buf) {
+    uint64_t r = atomic_load_explicit(&buf->readPosition, memory_order_relaxed);
+    uint64_t w = atomic_load_explicit(&buf->writePosition, memory_order_relaxed);
+    return w > r ? (int) (w - r) : 0;
+}
 
-    //sem_wait(buf->semaphore);
-    //spin lock until buffer space available
-    void *value = NULL;
-    while ((value = buf->buffer[buf->readPosition % buf->size]) == NULL) {
-        if (usleep(10) < 0) break;
+int stream_queue_try_add(struct ringBuffer *buf, void *newValue) {
+    if (try_add_batch(buf, &newValue, 1) == 0)
+        return FALSE;
+    if (buf->wait == STREAM_WAIT_BLOCK)
+        wake(buf, &buf->readers_waiting, &buf->not_empty);
+    return TRUE;
+}
+
+int stream_queue_try_get_batch(struct ringBuffer *buf, void **values, int max) {
+    int n = try_get_batch(buf, values, max);
+    if (n > 0 && buf->wait == STREAM_WAIT_BLOCK)
+        wake(buf, &buf->writers_waiting, &buf->not_full);
+    return n;
+}
+
+void *stream_queue_try_get(struct ringBuffer *buf) {
+    void *value;
+    if (stream_queue_try_get_batch(buf, &value, 1) == 0)
+        return NULL;
+    return value;
+}
+
+//producer
+void stream_queue_add_batch(struct ringBuffer *buf, void **values, int count) {
+    int spins = 0;
+    while (count > 0) {
+        int n = try_add_batch(buf, values, count);
+        if (n > 0) {
+            values += n;
+            count -= n;
+            spins = 0;
+            if (buf->wait == STREAM_WAIT_BLOCK)
+                wake(buf, &buf->readers_waiting, &buf->not_empty);
+            continue;
+        }
+        //wait until buffer space available
+        if (buf->wait == STREAM_WAIT_BLOCK && spins >= STREAM_SPIN_LIMIT) {
+            wait_begin(buf, &buf->writers_waiting);
+            while ((n = try_add_batch(buf, values, count)) == 0)
+                pthread_cond_wait(&buf->not_full, &buf->lock);
+            wait_end(buf, &buf->writers_waiting);
+            values += n;
+            count -= n;
+            wake(buf, &buf->readers_waiting, &buf->not_empty);
+            continue;
+        }
+        if (backoff(buf, spins++) < 0) usleep(10);
     }
-    buf->buffer[buf->readPosition % buf->size] = NULL;
-    buf->readPosition++;
+}
 
+void stream_queue_add(struct ringBuffer *buf, void *newValue) {
+    stream_queue_add_batch(buf, &newValue, 1);
+}
+
+//consumer
+int stream_queue_get_batch(struct ringBuffer *buf, void **values, int max) {
+    int n, spins = 0;
+    //wait until there is something to read
+    while ((n = try_get_batch(buf, values, max)) == 0) {
+        if (buf->wait == STREAM_WAIT_BLOCK && spins >= STREAM_SPIN_LIMIT) {
+            wait_begin(buf, &buf->readers_waiting);
+            while ((n = try_get_batch(buf, values, max)) == 0)
+                pthread_cond_wait(&buf->not_empty, &buf->lock);
+            wait_end(buf, &buf->readers_waiting);
+            break;
+        }
+        if (backoff(buf, spins++) < 0)
+            return 0;
+    }
+    if (buf->wait == STREAM_WAIT_BLOCK)
+        wake(buf, &buf->writers_waiting, &buf->not_full);
+    return n;
+}
+
+void *stream_queue_get(struct ringBuffer *buf) {
+    void *value;
+    if (stream_queue_get_batch(buf, &value, 1) == 0)
+        return NULL;
     return value;
 }
 
 void stream_queue_destroy(struct ringBuffer *buf) {
+    pthread_mutex_destroy(&buf->lock);
+    pthread_cond_destroy(&buf->not_empty);
+    pthread_cond_destroy(&buf->not_full);
     free(buf->buffer);
     free(buf);
 }
+
+// Hidden header in front of every pool buffer so stream_pool_put can find its way home.
+// 16 bytes keeps the buffer that follows 16 byte aligned, as malloc would.
+typedef struct pool_block {
+    stream_pool_t *pool;
+    uint32_t size_class;
+    uint32_t unused;
+} pool_block_t;
+
+stream_pool_t *stream_pool_create(int depth) {
+    int c;
+    stream_pool_t *pool = calloc(1, sizeof(stream_pool_t));
+    if (pool == NULL)
+        return NULL;
+    pool->depth = depth;
+    for (c = 0; c < STREAM_POOL_CLASSES; c++)
+        pool->free_list[c] = stream_queue_create(depth, STREAM_QUEUE_MPSC, STREAM_WAIT_SLEEP);
+    atomic_init(&pool->refs, 1);
+    return pool;
+}
+
+static void pool_free(stream_pool_t *pool) {
+    int c;
+    void *block;
+    for (c = 0; c < STREAM_POOL_CLASSES; c++) {
+        while ((block = stream_queue_try_get(pool->free_list[c])) != NULL)
+            free(block);
+        stream_queue_destroy(pool->free_list[c]);
+    }
+    free(pool);
+}
+
+static void pool_unref(stream_pool_t *pool) {
+    if (atomic_fetch_sub(&pool->refs, 1) == 1)
+        pool_free(pool);
+}
+
+void *stream_pool_get(stream_pool_t *pool, size_t length) {
+    pool_block_t *block = NULL;
+    uint32_t c = 0;
+    while (c < STREAM_POOL_CLASSES && ((size_t) 1 << (c + STREAM_POOL_MIN_SHIFT)) < length)
+        c++;
+    if (pool != NULL && c < STREAM_POOL_CLASSES)
+        block = stream_queue_try_get(pool->free_list[c]);
+    if (block == NULL) {
+        // Too big for any class means an exact size one-off that is freed on return.
+        size_t capacity = c < STREAM_POOL_CLASSES ? (size_t) 1 << (c + STREAM_POOL_MIN_SHIFT) : length;
+        if ((block = malloc(sizeof(pool_block_t) + capacity)) == NULL)
+            return NULL;
+        if (pool != NULL)
+            atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+    }
+    else
+        atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+    block->pool = pool;
+    block->size_class = c;
+    if (pool != NULL) {
+        atomic_fetch_add(&pool->refs, 1);
+        int out = atomic_fetch_add_explicit(&pool->outstanding, 1, memory_order_relaxed) + 1;
+        if (out > atomic_load_explicit(&pool->high_water, memory_order_relaxed))
+            atomic_store_explicit(&pool->high_water, out, memory_order_relaxed);
+    }
+    return block + 1;
+}
+
+void stream_pool_put(void *buf) {
+    pool_block_t *block = ((pool_block_t *) buf) - 1;
+    stream_pool_t *pool = block->pool;
+    if (pool == NULL) {
+        free(block);
+        return;
+    }
+    atomic_fetch_sub_explicit(&pool->outstanding, 1, memory_order_relaxed);
+    if (block->size_class >= STREAM_POOL_CLASSES || !stream_queue_try_add(pool->free_list[block->size_class], block))
+        free(block);
+    pool_unref(pool);
+}
+
+void stream_pool_destroy(stream_pool_t *pool) {
+    if (pool != NULL)
+        pool_unref(pool);
+}
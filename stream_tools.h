@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <time.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #ifndef STREAM_TOOLS_H_
 #define STREAM_TOOLS_H_
@@ -21,6 +22,28 @@
 
 #define STREAM_FORMAT 0x0101
 
+// flags word: bit 0 marks the last record from a data file, bit 1 a truncated copy,
+// bits 8-15 hold the stream_codec_t the payload is compressed with and bits 16-17 the
+// stream_clock_t the timestamp was taken from.
+#define STREAM_FLAG_LAST 0x1
+// Set on copies from the router's monitoring tap whose payload was cut short, only
+// total_length - sizeof(stream_buffer_t) bytes of payload follow the header and
+// payload_length and compressed_length are cut to the bytes that were copied.
+#define STREAM_FLAG_TRUNCATED 0x2
+#define STREAM_FLAG_CODEC_SHIFT 8
+#define STREAM_FLAG_CODEC_MASK 0xff00
+#define STREAM_FLAG_CLOCK_SHIFT 16
+#define STREAM_FLAG_CLOCK_MASK 0x30000
+
+// Clock a source stamps records with. Latency is measured against the same clock so
+// realtime and TAI work across hosts whose clocks are synchronised, e.g. with PTP, while
+// monotonic is only meaningful when the source and the receiver share a host.
+typedef enum stream_clock {
+    STREAM_CLOCK_REALTIME = 0,
+    STREAM_CLOCK_TAI,
+    STREAM_CLOCK_MONOTONIC
+} stream_clock_t;
+
 typedef struct stream_buffer {
     uint32_t source_id;
     uint32_t total_length;
@@ -34,6 +57,31 @@ typedef struct stream_buffer {
     uint32_t payload[];
 } stream_buffer_t;
 
+// The router's frame builder publishes each time frame as one multipart message, this
+// header is the first part and each record that follows is a part of its own.
+#define STREAM_FRAME_ID 0xF4A3E000
+#define STREAM_FRAME_BY_COUNTER 0x1
+
+typedef struct stream_frame {
+    // Always STREAM_FRAME_ID so subscribers can filter on it like a source ID
+    uint32_t frame_id;
+    uint32_t magic;
+    // Records in the frame, sources that sent at least one and active sources that sent none
+    uint32_t records;
+    uint32_t sources;
+    uint32_t missing;
+    // STREAM_FRAME_BY_COUNTER if frames are cut by record_counter rather than timestamp
+    uint32_t flags;
+    uint64_t frame_number;
+    // Nanoseconds of timestamp, or records of record_counter, per frame
+    uint64_t window;
+} stream_frame_t;
+
+// A subscription to the router whose topic starts with this declares a filter, see the
+// README. Matching records are published as two parts, the topic then the record.
+// e.g. "filter:src=0xC0DA0001,0xC0DA0002;every=100;flags=0x1/0x1;after=1712000000.5"
+#define STREAM_FILTER_PREFIX "filter:"
+
 uint32_t stream_to_int(uint8_t *buf);
 
 void int_to_stream(uint8_t *buf, uint32_t data);
@@ -49,24 +97,277 @@ int time_subtract(struct timespec *result, struct timespec *t2,
 // Print a time value.
 void time_print(struct timespec *tv);
 
+// Convert "realtime", "tai" or "monotonic" to a stream_clock_t, -1 if unknown.
+int stream_clock_from_name(const char *name);
+
+const char *stream_clock_name(stream_clock_t clock);
+
+clockid_t stream_clock_id(stream_clock_t clock);
+
+// Read the clock a record with these flags was stamped with.
+void stream_clock_now(uint32_t flags, struct timespec *now);
+
+// Latency histogram in nanoseconds, log-linear like HdrHistogram. Each power of two is
+// split into STREAM_HIST_SUB linear buckets so a percentile is reported within 1/16 of
+// the true value, up to 2^STREAM_HIST_MAX_BITS ns (about 4.9 hours) which is where
+// larger values are counted. One thread records into a histogram.
+#define STREAM_HIST_SUB_BITS 4
+#define STREAM_HIST_SUB (1 << STREAM_HIST_SUB_BITS)
+#define STREAM_HIST_MAX_BITS 44
+#define STREAM_HIST_BUCKETS ((STREAM_HIST_MAX_BITS - STREAM_HIST_SUB_BITS + 1) * STREAM_HIST_SUB)
+
+typedef struct stream_hist {
+    uint64_t count;
+    // Records stamped later than they were received, a sign the clocks disagree
+    uint64_t negative;
+    uint64_t max;
+    uint64_t buckets[STREAM_HIST_BUCKETS];
+} stream_hist_t;
+
+void stream_hist_record(stream_hist_t *h, int64_t ns);
+
+// Value in ns that p percent of the records are at or below
+uint64_t stream_hist_percentile(stream_hist_t *h, double p);
+
+// Add from into into
+void stream_hist_merge(stream_hist_t *into, stream_hist_t *from);
+
+// One line of p50, p99, p99.9 and max after label
+void stream_hist_print(const char *label, stream_hist_t *h);
+
+// Latency per source at one point in the data flow, from the record's timestamp to when
+// it got there. Recorded and reported by one thread, other threads may only read it with
+// stream_latency_count and stream_latency_snapshot. Sources beyond STREAM_LATENCY_SOURCES
+// aren't measured.
+#define STREAM_LATENCY_SOURCES 64
+
+typedef struct stream_latency {
+    // Where it is measured, e.g. "ingest", used in the reports
+    char name[32];
+    // Seconds between reports, 0 = only the summary
+    int interval;
+    struct timespec last_report;
+    // A source's slot is filled in before count is raised past it and never changes after
+    _Atomic int count;
+    int last;
+    // Held while a histogram changes or is copied by another thread
+    _Atomic int lock;
+    uint32_t source_id[STREAM_LATENCY_SOURCES];
+    // Since the last report and since the start
+    stream_hist_t *recent[STREAM_LATENCY_SOURCES];
+    stream_hist_t *total[STREAM_LATENCY_SOURCES];
+} stream_latency_t;
+
+stream_latency_t *stream_latency_create(const char *name, int interval);
+
+// Record buf arriving at now, which must have been read with stream_clock_now(buf->flags)
+void stream_latency_record(stream_latency_t *l, stream_buffer_t *buf, struct timespec *now);
+
+// Print the histogram of each source since the last report if interval seconds have passed
+void stream_latency_tick(stream_latency_t *l);
+
+// Print the histogram of each source since the start
+void stream_latency_summary(stream_latency_t *l);
+
+// Sources in l so far, from any thread
+int stream_latency_count(stream_latency_t *l);
+
+// Copy source i's histogram since the start, including what hasn't been reported yet, into
+// h and return its source ID. From any thread, i must be below stream_latency_count.
+uint32_t stream_latency_snapshot(stream_latency_t *l, int i, stream_hist_t *h);
+
+void stream_latency_destroy(stream_latency_t *l);
+
+// Tracks the record_counter of one source to find lost, repeated and out of order records.
+// Which counters arrived is remembered for the STREAM_SEQUENCE_WINDOW below the newest, a
+// late record within the window fills its gap, one older than that is taken as the source
+// starting again from a lower counter.
+#define STREAM_SEQUENCE_WINDOW 1024
+
+typedef enum stream_sequence_result {
+    STREAM_SEQ_OK = 0,
+    STREAM_SEQ_GAP,
+    STREAM_SEQ_REORDERED,
+    STREAM_SEQ_DUPLICATE,
+    STREAM_SEQ_RESTART
+} stream_sequence_result_t;
+
+typedef struct stream_sequence {
+    uint32_t source_id;
+    int started;
+    // Counter expected next
+    uint64_t next;
+    uint64_t received;
+    // Counters skipped over and not seen since
+    uint64_t missing;
+    uint64_t gaps;
+    uint64_t reordered;
+    uint64_t duplicates;
+    uint64_t restarts;
+    // Counters missing from the first and the latest gap, inclusive
+    uint64_t first_gap[2];
+    uint64_t last_gap[2];
+    // One message a second, the rest are only counted
+    time_t last_alert;
+    uint64_t alerts_suppressed;
+    // Anomalies when the caller last reported
+    uint64_t reported;
+    // Bit c % STREAM_SEQUENCE_WINDOW is set if counter c arrived, for c in the window
+    uint64_t window[STREAM_SEQUENCE_WINDOW / 64];
+} stream_sequence_t;
+
+stream_sequence_result_t stream_sequence_slow(stream_sequence_t *s, uint64_t counter);
+
+// Account for a record. The expected counter costs a compare and a bit set.
+static inline stream_sequence_result_t stream_sequence_check(stream_sequence_t *s, uint64_t counter) {
+    if (counter != s->next || !s->started)
+        return stream_sequence_slow(s, counter);
+    s->window[(counter % STREAM_SEQUENCE_WINDOW) / 64] |= 1ULL << (counter % 64);
+    s->next++;
+    s->received++;
+    return STREAM_SEQ_OK;
+}
+
+// Gaps, reordered and duplicate records and restarts seen so far
+static inline uint64_t stream_sequence_anomalies(stream_sequence_t *s) {
+    return s->gaps + s->reordered + s->duplicates + s->restarts;
+}
+
+// Print what a stream_sequence_check that didn't return STREAM_SEQ_OK found, at most once
+// a second per source.
+void stream_sequence_alert(stream_sequence_t *s, stream_sequence_result_t result, uint64_t counter);
+
+// One line of counts and gap ranges
+void stream_sequence_print(stream_sequence_t *s);
+
+// How a queue waits when the ring is full (producer) or empty (consumer).
+// STREAM_WAIT_SLEEP is the original usleep(10) poll.
+// STREAM_WAIT_SPIN never gives up the core, lowest latency, burns a CPU per waiter.
+// STREAM_WAIT_YIELD spins for a while then calls sched_yield between polls.
+// STREAM_WAIT_BLOCK spins briefly then sleeps on a condition variable until woken,
+// idle threads cost nothing but each wakeup costs a futex call.
+typedef enum stream_wait {
+    STREAM_WAIT_SLEEP = 0,
+    STREAM_WAIT_SPIN,
+    STREAM_WAIT_YIELD,
+    STREAM_WAIT_BLOCK
+} stream_wait_t;
+
+// Which ends of a queue may be shared between threads. Both types have a single
+// consumer. STREAM_QUEUE_MPSC is safe for any number of producers and is what every
+// queue used before the types existed. STREAM_QUEUE_SPSC needs no atomic read-modify-write
+// at all and must only ever have one producer thread.
+typedef enum stream_queue_type {
+    STREAM_QUEUE_MPSC = 0,
+    STREAM_QUEUE_SPSC
+} stream_queue_type_t;
+
+#define STREAM_CACHE_LINE 64
+
+// The producer and consumer indices live on their own cache lines so the two sides
+// don't false-share. Each side keeps a cached copy of the other side's index and only
+// reads the real one when the ring looks full or empty.
 typedef struct ringBuffer {
     char name[64];
-    char max_length;
-    void **buffer;
-    uint64_t writePosition;
-    uint64_t readPosition;
+    stream_queue_type_t type;
+    stream_wait_t wait;
+    _Atomic(void *) *buffer;
+    // size is always a power of two so positions are masked rather than divided
     size_t size;
+    uint64_t mask;
+    // Producer side
+    _Alignas(STREAM_CACHE_LINE) _Atomic uint64_t writePosition;
+    _Atomic uint64_t cachedRead;
+    // Consumer side
+    _Alignas(STREAM_CACHE_LINE) _Atomic uint64_t readPosition;
+    uint64_t cachedWrite;
+    // Set by stream_queue_allow_evict, producers may then take values from the consumer
+    // side and both sides serialise on consumer_lock.
+    int evictable;
+    _Atomic int consumer_lock;
+    // Only used by STREAM_WAIT_BLOCK
+    _Alignas(STREAM_CACHE_LINE) pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    _Atomic int readers_waiting;
+    _Atomic int writers_waiting;
 } stream_rb_t;
 
-//init
-struct ringBuffer *stream_queue_create(int size);
+// Convert "sleep", "spin", "yield" or "block" to a stream_wait_t, -1 if unknown.
+int stream_wait_from_name(const char *name);
+
+const char *stream_wait_name(stream_wait_t wait);
 
-//producer
+//init, size is rounded up to the next power of two
+struct ringBuffer *stream_queue_create(int size, stream_queue_type_t type, stream_wait_t wait);
+
+//producer, waits until there is room. NULL can't be queued.
 void stream_queue_add(struct ringBuffer *buf, void *newValue);
 
-//consumer
+//producer, waits until all count values are queued. They are queued in order but
+//with MPSC may be interleaved with other producers' values.
+void stream_queue_add_batch(struct ringBuffer *buf, void **values, int count);
+
+//producer, returns FALSE immediately if the ring is full
+int stream_queue_try_add(struct ringBuffer *buf, void *newValue);
+
+//consumer, waits for a value. Returns NULL only if a STREAM_WAIT_SLEEP wait was
+//interrupted by a signal.
 void *stream_queue_get(struct ringBuffer *buf);
 
+//consumer, waits for at least one value then returns up to max of them
+int stream_queue_get_batch(struct ringBuffer *buf, void **values, int max);
+
+//consumer, returns NULL immediately if the ring is empty
+void *stream_queue_try_get(struct ringBuffer *buf);
+
+//consumer, returns up to max values without waiting, 0 if the ring is empty
+int stream_queue_try_get_batch(struct ringBuffer *buf, void **values, int max);
+
+//Let producers remove the oldest value with stream_queue_evict. Call before the queue is
+//used. The consumer then takes a spin lock on every get so only do it where it's needed.
+void stream_queue_allow_evict(struct ringBuffer *buf);
+
+//producer, removes and returns the oldest value so there is room for a new one. Returns
+//NULL if there was nothing to remove.
+void *stream_queue_evict(struct ringBuffer *buf);
+
+//either side, number of values queued. Only a snapshot when the other side is busy.
+int stream_queue_count(struct ringBuffer *buf);
+
 void stream_queue_destroy(struct ringBuffer *buf);
 
+// A pool of reusable buffers in power of two size classes from 256 bytes up. Buffers are
+// taken by the one thread that owns the pool and may be returned from any thread, each
+// class keeps up to depth (rounded up to a power of two) free buffers on an MPSC queue
+// so a return never takes a lock.
+// Buffers are malloc'ed the first time a class runs dry and recycled from then on. The
+// pool is freed when it has been destroyed and the last buffer taken from it returned.
+#define STREAM_POOL_MIN_SHIFT 8
+#define STREAM_POOL_CLASSES 24
+
+typedef struct stream_pool {
+    char name[64];
+    int depth;
+    stream_rb_t *free_list[STREAM_POOL_CLASSES];
+    // one for the owner plus one per buffer handed out
+    _Atomic int refs;
+    // hits and misses are only written by the owner
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic int outstanding;
+    _Atomic int high_water;
+} stream_pool_t;
+
+stream_pool_t *stream_pool_create(int depth);
+
+// Returns a buffer of at least length bytes. With a NULL pool this is a plain malloc
+// that can still be released with stream_pool_put.
+void *stream_pool_get(stream_pool_t *pool, size_t length);
+
+// Return a buffer obtained from stream_pool_get, from any thread.
+void stream_pool_put(void *buf);
+
+void stream_pool_destroy(stream_pool_t *pool);
+
 #endif /* STREAM_TOOLS_H_ */
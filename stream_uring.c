@@ -0,0 +1,157 @@
+/*
+ * stream_uring.c
+ *
+ * See stream_uring.h
+ */
+
+#include "stream_uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int stream_uring_init(stream_uring_t *ring, unsigned entries) {
+    struct io_uring_params p;
+    memset(ring, 0, sizeof(stream_uring_t));
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -errno;
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    // Since 5.4 both rings live in one mapping
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = 0;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail;
+    ring->cq_ptr = ring->sq_ptr;
+    if (ring->cq_len > 0) {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+    uint8_t *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = ring->submitted = *ring->sq_tail;
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return 0;
+fail: {
+        int err = -errno;
+        stream_uring_exit(ring);
+        return err;
+    }
+}
+
+int stream_uring_setup_buffers(stream_uring_t *ring, unsigned count, unsigned size, uint16_t group) {
+    struct io_uring_buf_reg reg;
+    unsigned i;
+    ring->buf_ring_len = count * sizeof(struct io_uring_buf);
+    // The buffer ring must be page aligned
+    ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -errno;
+    }
+    if ((ring->buffers = malloc((size_t) count * size)) == NULL)
+        return -ENOMEM;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -errno;
+    ring->buf_count = count;
+    ring->buf_size = size;
+    ring->buf_group = group;
+    for (i = 0; i < count; i++) {
+        struct io_uring_buf *b = &ring->buf_ring->bufs[i];
+        b->addr = (uint64_t) (uintptr_t) (ring->buffers + (size_t) i * size);
+        b->len = size;
+        b->bid = i;
+    }
+    __atomic_store_n(&ring->buf_ring->tail, (uint16_t) count, __ATOMIC_RELEASE);
+    return 0;
+}
+
+struct io_uring_sqe *stream_uring_get_sqe(stream_uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries)
+        return NULL;
+    unsigned index = ring->sqe_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    ring->sq_array[index] = index;
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+int stream_uring_submit_and_wait(stream_uring_t *ring, unsigned wait_nr) {
+    unsigned to_submit = ring->sqe_tail - ring->submitted;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    ring->submitted = ring->sqe_tail;
+    ring->enters++;
+    int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+                      wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *stream_uring_peek_cqe(stream_uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void stream_uring_cqe_seen(stream_uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+uint8_t *stream_uring_buffer(stream_uring_t *ring, unsigned bid) {
+    return ring->buffers + (size_t) bid * ring->buf_size;
+}
+
+void stream_uring_buffer_return(stream_uring_t *ring, unsigned bid) {
+    uint16_t tail = ring->buf_ring->tail;
+    struct io_uring_buf *b = &ring->buf_ring->bufs[tail & (ring->buf_count - 1)];
+    b->addr = (uint64_t) (uintptr_t) stream_uring_buffer(ring, bid);
+    b->len = ring->buf_size;
+    b->bid = bid;
+    __atomic_store_n(&ring->buf_ring->tail, (uint16_t) (tail + 1), __ATOMIC_RELEASE);
+}
+
+void stream_uring_exit(stream_uring_t *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_len > 0 && ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->buf_ring != NULL)
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    free(ring->buffers);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    ring->fd = -1;
+}
@@ -0,0 +1,75 @@
+/*
+ * stream_uring.h
+ *
+ * Minimal io_uring plumbing on top of the raw system calls, just enough for the
+ * router's receive engine: one submission and completion ring plus a ring of
+ * provided buffers that the kernel fills for IOSQE_BUFFER_SELECT receives.
+ * Avoids a dependency on liburing, which the DAQ nodes don't all have.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#ifndef STREAM_URING_H_
+#define STREAM_URING_H_
+
+typedef struct stream_uring {
+    int fd;
+    // Submission queue, sqe_tail runs ahead of *sq_tail until the next submit
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned submitted;
+    struct io_uring_sqe *sqes;
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings, released by stream_uring_exit
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+    // Provided buffers
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    uint8_t *buffers;
+    unsigned buf_count;
+    unsigned buf_size;
+    uint16_t buf_group;
+    // Number of io_uring_enter calls made
+    uint64_t enters;
+} stream_uring_t;
+
+// Set up a ring with the given number of submission entries, returns 0 or -errno.
+int stream_uring_init(stream_uring_t *ring, unsigned entries);
+
+// Register count buffers of size bytes each as provided buffer group group. count must be
+// a power of two. Returns 0 or -errno, kernels before 5.19 return -EINVAL.
+int stream_uring_setup_buffers(stream_uring_t *ring, unsigned count, unsigned size, uint16_t group);
+
+// Next free submission entry, zeroed, or NULL if the submission queue is full.
+struct io_uring_sqe *stream_uring_get_sqe(stream_uring_t *ring);
+
+// Submit everything queued and wait for at least wait_nr completions.
+int stream_uring_submit_and_wait(stream_uring_t *ring, unsigned wait_nr);
+
+// Oldest unseen completion or NULL, stream_uring_cqe_seen releases it.
+struct io_uring_cqe *stream_uring_peek_cqe(stream_uring_t *ring);
+
+void stream_uring_cqe_seen(stream_uring_t *ring);
+
+// Data of the provided buffer a completion used, and give that buffer back to the kernel.
+uint8_t *stream_uring_buffer(stream_uring_t *ring, unsigned bid);
+
+void stream_uring_buffer_return(stream_uring_t *ring, unsigned bid);
+
+void stream_uring_exit(stream_uring_t *ring);
+
+#endif /* STREAM_URING_H_ */